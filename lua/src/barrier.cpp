@@ -0,0 +1,322 @@
+#include "xlua.hpp"
+#include "xlua_prototypes.hpp"
+#include <algorithm>
+#include <mutex>
+#include <sstream>
+
+namespace hpx {
+
+ptr_type sync_empty() {
+  return ptr_type(new std::vector<Holder>());
+}
+
+//--- Count k arrivals, return the future of the generation they
+//--- belong to
+future_type sync_arrive(sync_ptr s,std::size_t k) {
+  std::shared_ptr<hpx::lcos::local::promise<ptr_type> > fire;
+  future_type f;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(s->mtx);
+    f = s->ready;
+    if(s->arrived < s->expected) {
+      s->arrived += k;
+      if(s->arrived >= s->expected) {
+        fire = s->done;
+        if(s->reusable) {
+          s->arrived = 0;
+          s->done.reset(new hpx::lcos::local::promise<ptr_type>());
+          s->ready = s->done->get_future();
+        }
+      }
+    }
+  }
+  // Outside the lock, continuations may arrive again
+  if(fire.get() != nullptr)
+    fire->set_value(sync_empty());
+  return f;
+}
+
+sync_ptr make_sync(std::size_t n,bool reusable) {
+  if(n == 0 && reusable)
+    n = 1;
+  sync_ptr s{new sync_inner(n,reusable)};
+  if(n == 0 && !reusable)
+    s->done->set_value(sync_empty());
+  return s;
+}
+
+//--- Barriers across localities live on the root locality, one per
+//--- name, made by the first to arrive and kept until b:Free()
+std::map<std::string,sync_ptr> global_barriers;
+hpx::lcos::local::spinlock global_barriers_mtx;
+
+int global_barrier_arrived(future_type f) {
+  f.get();
+  return 1;
+}
+
+//--- Ready once the round this arrival belongs to is complete. It
+//--- doesn't hold a thread on the root locality while waiting. All
+//--- localities must agree on n.
+hpx::future<int> global_barrier_arrive(std::string name,std::size_t n) {
+  sync_ptr s;
+  std::size_t expected;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(global_barriers_mtx);
+    sync_ptr& e = global_barriers[name];
+    if(e.get() == nullptr)
+      e = make_sync(n,true);
+    s = e;
+    expected = e->expected;
+  }
+  if(expected != std::max<std::size_t>(n,1)) {
+    std::ostringstream msg;
+    msg << "barrier_t.global('" << name << "') is for " << expected
+        << " arrivals, not " << n;
+    return hpx::make_exceptional_future<int>(
+      boost::copy_exception(std::runtime_error(msg.str())));
+  }
+  return sync_arrive(s,1).then(global_barrier_arrived);
+}
+
+int global_barrier_free(std::string name) {
+  std::lock_guard<hpx::lcos::local::spinlock> lock(global_barriers_mtx);
+  global_barriers.erase(name);
+  return 1;
+}
+
+}
+
+HPX_PLAIN_ACTION(hpx::global_barrier_arrive,global_barrier_arrive_action);
+HPX_PLAIN_ACTION(hpx::global_barrier_free,global_barrier_free_action);
+
+namespace hpx {
+
+ptr_type global_barrier_done(hpx::future<int> f) {
+  f.get();
+  return sync_empty();
+}
+
+int new_sync_ud(lua_State *L,const char *mt) {
+  size_t nbytes = sizeof(sync_ptr);
+  char *mem = (char *)lua_newuserdata(L,nbytes);
+  new (mem) sync_ptr();
+  luaL_setmetatable(L,mt);
+  return 1;
+}
+
+int new_latch(lua_State *L) {
+  return new_sync_ud(L,latch_metatable_name);
+}
+
+int new_barrier(lua_State *L) {
+  return new_sync_ud(L,barrier_metatable_name);
+}
+
+int hpx_sync_clean(lua_State *L) {
+    if(cmp_meta(L,-1,latch_metatable_name) || cmp_meta(L,-1,barrier_metatable_name)) {
+      sync_ptr *fnc = (sync_ptr *)lua_touserdata(L,-1);
+      dtor(fnc);
+    }
+    return 1;
+}
+
+void push_sync_future(lua_State *L,future_type f) {
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = f;
+}
+
+std::size_t get_count(lua_State *L,int index,std::size_t dflt) {
+  if(lua_isnumber(L,index) && lua_tonumber(L,index) >= 0)
+    return lua_tointeger(L,index);
+  return dflt;
+}
+
+//---latch structure--//
+
+//--- latch_t.new(n) is ready after n calls to CountDown()
+int latch_new(lua_State *L) {
+  std::size_t n = get_count(L,1,1);
+  lua_pop(L,lua_gettop(L));
+  new_latch(L);
+  *(sync_ptr *)lua_touserdata(L,-1) = make_sync(n,false);
+  return 1;
+}
+
+int latch_name(lua_State *L) {
+  lua_pushstring(L,latch_metatable_name);
+  return 1;
+}
+
+//--- l:CountDown([k])
+int latch_count_down(lua_State *L) {
+  if(!cmp_meta(L,1,latch_metatable_name))
+    return 0;
+  sync_ptr s = *(sync_ptr *)lua_touserdata(L,1);
+  std::size_t k = get_count(L,2,1);
+  lua_pop(L,lua_gettop(L));
+  sync_arrive(s,k);
+  return 0;
+}
+
+//--- l:Wait() is a future, ready when the count reaches zero
+int latch_wait(lua_State *L) {
+  if(!cmp_meta(L,1,latch_metatable_name))
+    return 0;
+  sync_ptr s = *(sync_ptr *)lua_touserdata(L,1);
+  lua_pop(L,lua_gettop(L));
+  future_type f;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(s->mtx);
+    f = s->ready;
+  }
+  push_sync_future(L,f);
+  return 1;
+}
+
+//--- l:ArriveAndWait([k]) is CountDown(k) followed by Wait()
+int latch_arrive_and_wait(lua_State *L) {
+  if(!cmp_meta(L,1,latch_metatable_name))
+    return 0;
+  sync_ptr s = *(sync_ptr *)lua_touserdata(L,1);
+  std::size_t k = get_count(L,2,1);
+  lua_pop(L,lua_gettop(L));
+  push_sync_future(L,sync_arrive(s,k));
+  return 1;
+}
+
+int latch_is_ready(lua_State *L) {
+  if(!cmp_meta(L,1,latch_metatable_name))
+    return 0;
+  sync_ptr s = *(sync_ptr *)lua_touserdata(L,1);
+  lua_pop(L,lua_gettop(L));
+  bool ready;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(s->mtx);
+    ready = s->ready.is_ready();
+  }
+  lua_pushboolean(L,ready);
+  return 1;
+}
+
+int open_latch(lua_State *L) {
+    static const struct luaL_Reg latch_meta_funcs [] = {
+        {"CountDown",&latch_count_down},
+        {"Wait",&latch_wait},
+        {"ArriveAndWait",&latch_arrive_and_wait},
+        {"IsReady",&latch_is_ready},
+        {"Name",&latch_name},
+        {NULL,NULL},
+    };
+
+    static const struct luaL_Reg latch_funcs [] = {
+        {"new", &latch_new},
+        {NULL, NULL}
+    };
+
+    luaL_newlib(L,latch_funcs);
+
+    luaL_newmetatable(L,latch_metatable_name);
+    luaL_newlib(L, latch_meta_funcs);
+    lua_setfield(L,-2,"__index");
+
+    lua_pushstring(L,"__gc");
+    lua_pushcfunction(L,hpx_sync_clean);
+    lua_settable(L,-3);
+
+    lua_pop(L,1);
+
+    return 1;
+}
+
+//---barrier structure--//
+
+//--- barrier_t.new(n) is for n tasks on this locality
+int barrier_new(lua_State *L) {
+  std::size_t n = get_count(L,1,1);
+  lua_pop(L,lua_gettop(L));
+  new_barrier(L);
+  *(sync_ptr *)lua_touserdata(L,-1) = make_sync(n,true);
+  return 1;
+}
+
+//--- barrier_t.global(name[,n]) is for n tasks anywhere, one per
+//--- locality by default. Every locality uses the same name.
+int barrier_global(lua_State *L) {
+  CHECK_STRING(1,"barrier_t.global")
+  std::string name = lua_tostring(L,1);
+  std::size_t n = get_count(L,2,hpx::find_all_localities().size());
+  lua_pop(L,lua_gettop(L));
+  new_barrier(L);
+  sync_ptr s = make_sync(n,true);
+  s->global_name = name;
+  *(sync_ptr *)lua_touserdata(L,-1) = s;
+  return 1;
+}
+
+int barrier_name(lua_State *L) {
+  lua_pushstring(L,barrier_metatable_name);
+  return 1;
+}
+
+//--- b:Arrive() is a future, ready once all n have arrived. The
+//--- barrier can then be used for the next round.
+int barrier_arrive(lua_State *L) {
+  if(!cmp_meta(L,1,barrier_metatable_name))
+    return 0;
+  sync_ptr s = *(sync_ptr *)lua_touserdata(L,1);
+  lua_pop(L,lua_gettop(L));
+  if(s->global_name.size() > 0) {
+    hpx::future<int> f = hpx::async<global_barrier_arrive_action>(
+      hpx::find_root_locality(),s->global_name,s->expected);
+    push_sync_future(L,f.then(global_barrier_done));
+  } else {
+    push_sync_future(L,sync_arrive(s,1));
+  }
+  return 1;
+}
+
+//--- b:Free() drops a global barrier's state on the root locality,
+//--- once no locality arrives at it anymore. The next arrival under
+//--- the name starts a new barrier. Nothing to do for local ones.
+int barrier_free(lua_State *L) {
+  if(!cmp_meta(L,1,barrier_metatable_name))
+    return 0;
+  sync_ptr s = *(sync_ptr *)lua_touserdata(L,1);
+  lua_pop(L,lua_gettop(L));
+  if(s->global_name.size() > 0)
+    hpx::apply<global_barrier_free_action>(hpx::find_root_locality(),s->global_name);
+  return 0;
+}
+
+int open_barrier(lua_State *L) {
+    static const struct luaL_Reg barrier_meta_funcs [] = {
+        {"Arrive",&barrier_arrive},
+        {"Free",&barrier_free},
+        {"Name",&barrier_name},
+        {NULL,NULL},
+    };
+
+    static const struct luaL_Reg barrier_funcs [] = {
+        {"new", &barrier_new},
+        {"global", &barrier_global},
+        {NULL, NULL}
+    };
+
+    luaL_newlib(L,barrier_funcs);
+
+    luaL_newmetatable(L,barrier_metatable_name);
+    luaL_newlib(L, barrier_meta_funcs);
+    lua_setfield(L,-2,"__index");
+
+    lua_pushstring(L,"__gc");
+    lua_pushcfunction(L,hpx_sync_clean);
+    lua_settable(L,-3);
+
+    lua_pop(L,1);
+
+    return 1;
+}
+
+}
@@ -0,0 +1,219 @@
+#include "xlua.hpp"
+#include "xlua_prototypes.hpp"
+#include <mutex>
+
+namespace hpx {
+
+typedef channel_inner::waiter_type waiter_type;
+
+//--- Userdata for a channel, filled in by the caller
+int new_channel(lua_State *L) {
+  size_t nbytes = sizeof(channel_ptr);
+  char *mem = (char *)lua_newuserdata(L,nbytes);
+  new (mem) channel_ptr();
+  luaL_setmetatable(L,channel_metatable_name);
+  return 1;
+}
+
+//--- channel_t.new([capacity]) is unbounded without a capacity. With
+//--- one, Send() waits for room once capacity values are queued.
+int channel_new(lua_State *L) {
+  std::size_t capacity = 0;
+  if(lua_isnumber(L,1) && lua_tonumber(L,1) > 0)
+    capacity = lua_tointeger(L,1);
+  lua_pop(L,lua_gettop(L));
+  new_channel(L);
+  channel_ptr *cp = (channel_ptr *)lua_touserdata(L,-1);
+  cp->reset(new channel_inner());
+  (*cp)->capacity = capacity;
+  return 1;
+}
+
+int hpx_channel_clean(lua_State *L) {
+    if(cmp_meta(L,-1,channel_metatable_name)) {
+      channel_ptr *fnc = (channel_ptr *)lua_touserdata(L,-1);
+      dtor(fnc);
+    }
+    return 1;
+}
+
+int channel_name(lua_State *L) {
+  lua_pushstring(L,channel_metatable_name);
+  return 1;
+}
+
+ptr_type channel_value(const Holder& h) {
+  ptr_type pt{new std::vector<Holder>()};
+  pt->push_back(h);
+  return pt;
+}
+
+void push_channel_future(lua_State *L,future_type f) {
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = f;
+}
+
+//--- c:Send(x) queues x, or hands it straight to a waiting receiver.
+//--- The future is ready once x is in the channel, which for a full
+//--- bounded channel is when a receiver makes room. x can't be nil,
+//--- that is what Recv() gives once the channel is closed.
+int channel_send(lua_State *L) {
+  if(!cmp_meta(L,1,channel_metatable_name))
+    return 0;
+  channel_ptr ch = *(channel_ptr *)lua_touserdata(L,1);
+  if(lua_isnoneornil(L,2)) {
+    luai_writestringerror("Can't send nil on a '%s' ",channel_metatable_name);
+    return 0;
+  }
+  Holder h;
+  h.pack(L,2);
+  lua_pop(L,lua_gettop(L));
+
+  waiter_type receiver, sender;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(ch->mtx);
+    if(ch->closed) {
+      luai_writestringerror("Send on a closed '%s' ",channel_metatable_name);
+      return 0;
+    }
+    if(ch->receivers.size() > 0) {
+      receiver = ch->receivers.front();
+      ch->receivers.pop_front();
+    } else if(ch->capacity == 0 || ch->items.size() < ch->capacity) {
+      ch->items.push_back(h);
+    } else {
+      sender.reset(new hpx::lcos::local::promise<ptr_type>());
+      ch->senders.push_back(std::make_pair(h,sender));
+    }
+  }
+  // Outside the lock, the receiver's continuations may use the channel
+  if(receiver.get() != nullptr)
+    receiver->set_value(channel_value(h));
+  if(sender.get() != nullptr)
+    push_channel_future(L,sender->get_future());
+  else
+    push_channel_future(L,hpx::make_ready_future(ptr_type(new std::vector<Holder>())));
+  return 1;
+}
+
+//--- c:Recv() is a future of the next value, or of nothing once the
+//--- channel is closed and empty
+int channel_recv(lua_State *L) {
+  if(!cmp_meta(L,1,channel_metatable_name))
+    return 0;
+  channel_ptr ch = *(channel_ptr *)lua_touserdata(L,1);
+  lua_pop(L,lua_gettop(L));
+
+  waiter_type receiver, sender;
+  Holder h;
+  bool ready = false;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(ch->mtx);
+    if(ch->items.size() > 0) {
+      h = ch->items.front();
+      ch->items.pop_front();
+      ready = true;
+      if(ch->senders.size() > 0) {
+        ch->items.push_back(ch->senders.front().first);
+        sender = ch->senders.front().second;
+        ch->senders.pop_front();
+      }
+    } else if(ch->closed) {
+      ready = true;
+    } else {
+      receiver.reset(new hpx::lcos::local::promise<ptr_type>());
+      ch->receivers.push_back(receiver);
+    }
+  }
+  if(sender.get() != nullptr)
+    sender->set_value(ptr_type(new std::vector<Holder>()));
+  if(ready) {
+    ptr_type pt{new std::vector<Holder>()};
+    h.push(pt);
+    push_channel_future(L,hpx::make_ready_future(pt));
+  } else {
+    push_channel_future(L,receiver->get_future());
+  }
+  return 1;
+}
+
+//--- c:Close() lets waiting and later receivers drain what is left,
+//--- then get nothing. Values of senders still waiting for room are
+//--- queued past the capacity, so their futures become ready too.
+//--- Sending to a closed channel is an error.
+int channel_close(lua_State *L) {
+  if(!cmp_meta(L,1,channel_metatable_name))
+    return 0;
+  channel_ptr ch = *(channel_ptr *)lua_touserdata(L,1);
+  lua_pop(L,lua_gettop(L));
+  std::deque<waiter_type> receivers;
+  std::deque<waiter_type> senders;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(ch->mtx);
+    ch->closed = true;
+    receivers.swap(ch->receivers);
+    for(auto s = ch->senders.begin();s != ch->senders.end();++s) {
+      ch->items.push_back(s->first);
+      senders.push_back(s->second);
+    }
+    ch->senders.clear();
+  }
+  for(auto r = receivers.begin();r != receivers.end();++r)
+    (*r)->set_value(ptr_type(new std::vector<Holder>()));
+  for(auto s = senders.begin();s != senders.end();++s)
+    (*s)->set_value(ptr_type(new std::vector<Holder>()));
+  return 0;
+}
+
+//--- c:Size() is the number of values queued, including those of
+//--- senders waiting for room
+int channel_size(lua_State *L) {
+  if(!cmp_meta(L,1,channel_metatable_name))
+    return 0;
+  channel_ptr ch = *(channel_ptr *)lua_touserdata(L,1);
+  lua_pop(L,lua_gettop(L));
+  std::size_t n;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(ch->mtx);
+    n = ch->items.size() + ch->senders.size();
+  }
+  lua_pushnumber(L,n);
+  return 1;
+}
+
+int open_channel(lua_State *L) {
+    static const struct luaL_Reg channel_meta_funcs [] = {
+        {"Send",&channel_send},
+        {"Recv",&channel_recv},
+        {"Close",&channel_close},
+        {"Size",&channel_size},
+        {"Name",&channel_name},
+        {NULL,NULL},
+    };
+
+    static const struct luaL_Reg channel_funcs [] = {
+        {"new", &channel_new},
+        {NULL, NULL}
+    };
+
+    luaL_newlib(L,channel_funcs);
+
+    luaL_newmetatable(L,channel_metatable_name);
+    luaL_newlib(L, channel_meta_funcs);
+    lua_setfield(L,-2,"__index");
+
+    lua_pushstring(L,"__gc");
+    lua_pushcfunction(L,hpx_channel_clean);
+    lua_settable(L,-3);
+
+    lua_pushstring(L,"__len");
+    lua_pushcfunction(L,channel_size);
+    lua_settable(L,-3);
+
+    lua_pop(L,1);
+
+    return 1;
+}
+
+}
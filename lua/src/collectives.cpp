@@ -0,0 +1,243 @@
+#include "xlua.hpp"
+#include "xlua_prototypes.hpp"
+#include <hpx/lcos/broadcast.hpp>
+#include <hpx/lcos/reduce.hpp>
+#include <algorithm>
+
+namespace hpx {
+
+//--- Built in reduction operators
+enum collective_op_type { op_sum, op_min, op_max };
+
+//--- Numbers combine directly, vectors element by element. Anything
+//--- else keeps the left value.
+Holder combine_holders(const Holder& a,const Holder& b,int op) {
+  if(a.var.which() == Holder::empty_t)
+    return b;
+  if(b.var.which() == Holder::empty_t)
+    return a;
+  Holder h;
+  if(a.var.which() == Holder::num_t && b.var.which() == Holder::num_t) {
+    double x = boost::get<double>(a.var);
+    double y = boost::get<double>(b.var);
+    h.var = op == op_sum ? x+y : op == op_min ? std::min(x,y) : std::max(x,y);
+    return h;
+  }
+  if(a.var.which() == Holder::vector_t && b.var.which() == Holder::vector_t) {
+    const vector_ptr& x = boost::get<vector_ptr>(a.var);
+    const vector_ptr& y = boost::get<vector_ptr>(b.var);
+    vector_ptr z{new std::vector<double>(std::max(x->size(),y->size()))};
+    for(std::size_t i=1;i<z->size();i++) {
+      if(i >= x->size())
+        (*z)[i] = (*y)[i];
+      else if(i >= y->size())
+        (*z)[i] = (*x)[i];
+      else if(op == op_sum)
+        (*z)[i] = (*x)[i] + (*y)[i];
+      else if(op == op_min)
+        (*z)[i] = std::min((*x)[i],(*y)[i]);
+      else
+        (*z)[i] = std::max((*x)[i],(*y)[i]);
+    }
+    h.var = z;
+    return h;
+  }
+  return a;
+}
+
+//--- Sent along with hpx::lcos::reduce, combines the return values
+//--- of two localities position by position
+struct collective_op {
+  int op = op_sum;
+
+  collective_op() {}
+  collective_op(int op_) : op(op_) {}
+
+  ptr_type operator()(const ptr_type& a,const ptr_type& b) const {
+    ptr_type pt{new std::vector<Holder>()};
+    std::size_t n = std::max(a->size(),b->size());
+    for(std::size_t i=0;i<n;i++) {
+      if(i >= a->size())
+        pt->push_back((*b)[i]);
+      else if(i >= b->size())
+        pt->push_back((*a)[i]);
+      else
+        pt->push_back(combine_holders((*a)[i],(*b)[i],op));
+    }
+    return pt;
+  }
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & op;
+    }
+};
+
+ptr_type collective_run(closure_ptr cl,ptr_type args) {
+  return luax_async2(cl,args);
+}
+
+}
+
+HPX_PLAIN_ACTION(hpx::collective_run,collective_run_action);
+HPX_REGISTER_BROADCAST_ACTION_DECLARATION(collective_run_action);
+HPX_REGISTER_BROADCAST_ACTION(collective_run_action);
+HPX_REGISTER_REDUCE_ACTION_DECLARATION(collective_run_action,hpx::collective_op);
+HPX_REGISTER_REDUCE_ACTION(collective_run_action,hpx::collective_op);
+
+namespace hpx {
+
+ptr_type pack_args(lua_State *L,int first) {
+  ptr_type args(new std::vector<Holder>());
+  int nargs = lua_gettop(L);
+  for(int i=first;i<=nargs;i++) {
+    Holder h;
+    h.pack(L,i);
+    h.push(args);
+  }
+  return args;
+}
+
+bool get_collective_op(lua_State *L,int index,int& op) {
+  if(!lua_isstring(L,index)) {
+    luai_writestringerror("Argument to '%s' is not an operator ","reduce");
+    return false;
+  }
+  std::string s = lua_tostring(L,index);
+  if(s == "+" || s == "sum")
+    op = op_sum;
+  else if(s == "min")
+    op = op_min;
+  else if(s == "max")
+    op = op_max;
+  else {
+    luai_writestringerror("Unknown operator '%s' in reduce, use '+', 'min' or 'max' ",s.c_str());
+    return false;
+  }
+  return true;
+}
+
+ptr_type broadcast_done(std::vector<ptr_type> results) {
+  return ptr_type(new std::vector<Holder>());
+}
+
+ptr_type gather_results(std::vector<ptr_type> results) {
+  table_ptr tp{new table_inner()};
+  for(std::size_t i=0;i<results.size();i++) {
+    Holder h;
+    if(results[i]->size() > 0)
+      h = (*results[i])[0];
+    double key = i+1;
+    (tp->t)[key] = h;
+    if(h.var.which() != Holder::empty_t && key == 1 + tp->size)
+      tp->size = key;
+  }
+  ptr_type pt{new std::vector<Holder>()};
+  Holder h;
+  h.var = tp;
+  pt->push_back(h);
+  return pt;
+}
+
+//--- Run g with the reduced values on every locality, then hand
+//--- them to the caller as well. f is ready here; the broadcast is
+//--- chained on rather than waited for.
+hpx::future<ptr_type> all_reduce_then(closure_ptr g,
+    std::vector<hpx::naming::id_type> locs,hpx::future<ptr_type> f) {
+  ptr_type res = f.get();
+  return hpx::lcos::broadcast<collective_run_action>(locs,g,res).then(
+    [res](hpx::future<std::vector<ptr_type> > done) {
+      done.get();
+      return res;
+    });
+}
+
+void push_result(lua_State *L,future_type f) {
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = f;
+}
+
+//--- hpx.broadcast(f,...) runs f(...) on every locality, the future
+//--- is ready when all of them are done
+int xlua_broadcast(lua_State *L) {
+  closure_ptr cl = getfunc(L,1);
+  ptr_type args = pack_args(L,2);
+  if(!check_exportable(args,cl))
+    return 0;
+  lua_pop(L,lua_gettop(L));
+  std::vector<hpx::naming::id_type> locs = hpx::find_all_localities();
+  export_keys keys;
+  export_futures(args,keys,locs.size());
+  auto f = release_after(hpx::lcos::broadcast<collective_run_action>(locs,cl,args),keys);
+  push_result(L,f.then(hpx::util::unwrapped(broadcast_done)));
+  return 1;
+}
+
+//--- hpx.gather(f,...) runs f(...) on every locality and returns a
+//--- future of a table with the first result of each, in the order
+//--- of find_all_localities()
+int xlua_gather(lua_State *L) {
+  closure_ptr cl = getfunc(L,1);
+  ptr_type args = pack_args(L,2);
+  if(!check_exportable(args,cl))
+    return 0;
+  lua_pop(L,lua_gettop(L));
+  std::vector<hpx::naming::id_type> locs = hpx::find_all_localities();
+  export_keys keys;
+  export_futures(args,keys,locs.size());
+  auto f = release_after(hpx::lcos::broadcast<collective_run_action>(locs,cl,args),keys);
+  push_result(L,f.then(hpx::util::unwrapped(gather_results)));
+  return 1;
+}
+
+//--- hpx.reduce(f,op,...) runs f(...) on every locality and combines
+//--- the results with op, one of '+', 'min' or 'max', along the tree
+int xlua_reduce(lua_State *L) {
+  int op;
+  if(!get_collective_op(L,2,op))
+    return 0;
+  closure_ptr cl = getfunc(L,1);
+  ptr_type args = pack_args(L,3);
+  if(!check_exportable(args,cl))
+    return 0;
+  lua_pop(L,lua_gettop(L));
+  std::vector<hpx::naming::id_type> locs = hpx::find_all_localities();
+  export_keys keys;
+  export_futures(args,keys,locs.size());
+  push_result(L,release_after(hpx::lcos::reduce<collective_run_action>(
+    locs,collective_op(op),cl,args),keys));
+  return 1;
+}
+
+//--- hpx.all_reduce(f,op,g,...) is hpx.reduce(f,op,...) followed by
+//--- hpx.broadcast(g,result), the future has the result too
+int xlua_all_reduce(lua_State *L) {
+  int op;
+  if(!get_collective_op(L,2,op))
+    return 0;
+  if(!lua_isfunction(L,3) && !lua_isstring(L,3)) {
+    luai_writestringerror("Argument to '%s' is not a function ","all_reduce");
+    return 0;
+  }
+  closure_ptr cl = getfunc(L,1);
+  closure_ptr g = getfunc(L,3);
+  ptr_type args = pack_args(L,4);
+  Holder hg;
+  hg.var = g;
+  if(!check_exportable(args,cl) || !check_exportable(hg))
+    return 0;
+  lua_pop(L,lua_gettop(L));
+  std::vector<hpx::naming::id_type> locs = hpx::find_all_localities();
+  export_keys keys;
+  export_futures(args,keys,locs.size());
+  hpx::future<ptr_type> f = release_after(hpx::lcos::reduce<collective_run_action>(
+    locs,collective_op(op),cl,args),keys);
+  hpx::future<ptr_type> res(f.then(boost::bind(all_reduce_then,g,locs,_1)));
+  push_result(L,std::move(res));
+  return 1;
+}
+
+}
@@ -1,6 +1,17 @@
 #include <hpx/hpx.hpp>
+#include <hpx/include/components.hpp>
+#if defined(HPX_HAVE_PARCEL_COALESCING)
+#include <hpx/include/parcel_coalescing.hpp>
+#endif
 #include "xlua.hpp"
 #include "xlua_prototypes.hpp"
+#include <hpx/lcos/local/spinlock.hpp>
+#include <hpx/lcos/local/mutex.hpp>
+#include <hpx/lcos/local/promise.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 
 namespace hpx
 {
@@ -11,32 +22,237 @@ inline bool is_bytecode(const std::string& s) {
   return s.size() > 4 && s[0] == 27 && s[1] == 'L' && s[2] == 'u' && s[3] == 'a';
 }
 
+//--- Set from the table passed to component.new(loc,{...})
+struct component_options {
+  bool dedicated = false; // keep a VM for this component's calls
+  bool direct = false;    // run calls on the parcel thread
+  bool actor = false;     // one request at a time, through a mailbox
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & dedicated;
+      ar & direct;
+      ar & actor;
+    }
+};
+
+//--- A request waiting in an actor component's mailbox
+enum mailbox_op { op_get, op_set, op_call, op_get_if_changed, op_get_range, op_set_range };
+
+struct mailbox_item {
+  int op;
+  closure_ptr cp;
+  std::vector<std::string> names;
+  ptr_type args;
+  hpx::lcos::local::promise<ptr_type> done;
+};
+
+//--- Methods cached by a dedicated VM before the cache is dropped
+const int max_cached_methods = 64;
+
+//--- Migratable: only the table and the options move. The dedicated
+//--- VM is rebuilt on demand at the new locality.
 struct lua_component
-  : hpx::components::simple_component_base<lua_component>
+  : hpx::components::migration_support<
+      hpx::components::simple_component_base<lua_component> >
 {
   table_ptr tp{new table_inner};
+  component_options opts;
 
-  ptr_type get(std::string name) {
-    ptr_type pt{new std::vector<Holder>()};
-    pt->push_back((tp->t)[name]);
-    return pt;
+  // Bumped after every write, lets readers revalidate cached values
+  std::atomic<boost::uint64_t> version{1};
+
+  // The dedicated VM and the number of methods it has loaded
+  std::unique_ptr<Lua> vm;
+  int cached_methods = 0;
+  hpx::lcos::local::mutex vm_mtx;
+
+  // Actor mode: requests from any thread, one drain task at a time
+  boost::lockfree::queue<mailbox_item *> mailbox{64};
+  std::atomic<bool> scheduled{false};
+
+  lua_component() {}
+
+  lua_component(component_options opts_) : opts(opts_) {}
+
+  // Used by migration, after the component was serialized
+  lua_component(lua_component&& rhs)
+    : tp(std::move(rhs.tp)), opts(rhs.opts), version(rhs.version.load()) {}
+
+  // Requests still queued get an error instead of a broken promise
+  ~lua_component() {
+    mailbox_item *item;
+    while(mailbox.pop(item)) {
+      item->done.set_exception(boost::copy_exception(std::runtime_error(
+        "lua_component destroyed before the request ran")));
+      delete item;
+    }
+  }
+
+  // The actions below go through the mailbox if the component is an
+  // actor, whichever client sent them. Otherwise they run at once.
+  hpx::future<ptr_type> get(std::string name) {
+    if(opts.actor)
+      return post(op_get,std::vector<std::string>{name},ptr_type(new std::vector<Holder>()));
+    return hpx::make_ready_future(get_many_now(std::vector<std::string>{name}));
   }
 
   HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,get);
 
-  ptr_type set(std::string name,Holder h) {
+  ptr_type get_if_changed_now(std::string name,double known_version) {
     ptr_type pt{new std::vector<Holder>()};
-    (tp->t)[name] = h;
+    // Read the version first, the value is at least that new
+    Holder hv;
+    hv.var = double(version.load());
+    pt->push_back(hv);
+    if(boost::get<double>(hv.var) != known_version)
+      pt->push_back((tp->t)[name]);
     return pt;
   }
 
+  hpx::future<ptr_type> get_if_changed(std::string name,double known_version) {
+    if(opts.actor) {
+      Holder hv;
+      hv.var = known_version;
+      return post(op_get_if_changed,std::vector<std::string>{name},ptr_type(new std::vector<Holder>{hv}));
+    }
+    return hpx::make_ready_future(get_if_changed_now(name,known_version));
+  }
+
+  HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,get_if_changed);
+
+  hpx::future<ptr_type> set(std::string name,Holder h) {
+    return set_many(std::vector<std::string>{name},std::vector<Holder>{h});
+  }
+
   HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,set);
 
-  ptr_type call(closure_ptr cp,ptr_type ptargs);
+  ptr_type get_many_now(const std::vector<std::string>& names) {
+    ptr_type pt{new std::vector<Holder>()};
+    for(auto i=names.begin();i != names.end();++i)
+      pt->push_back((tp->t)[*i]);
+    return pt;
+  }
+
+  hpx::future<ptr_type> get_many(std::vector<std::string> names) {
+    if(opts.actor)
+      return post(op_get,names,ptr_type(new std::vector<Holder>()));
+    return hpx::make_ready_future(get_many_now(names));
+  }
+
+  HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,get_many);
+
+  ptr_type set_many_now(const std::vector<std::string>& names,const std::vector<Holder>& values) {
+    ptr_type pt{new std::vector<Holder>()};
+    for(std::size_t i=0;i < names.size() && i < values.size();i++)
+      (tp->t)[names[i]] = values[i];
+    ++version;
+    return pt;
+  }
+
+  hpx::future<ptr_type> set_many(std::vector<std::string> names,std::vector<Holder> values) {
+    if(opts.actor)
+      return post(op_set,names,ptr_type(new std::vector<Holder>(values)));
+    return hpx::make_ready_future(set_many_now(names,values));
+  }
+
+  HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,set_many);
+
+  ptr_type get_range_now(std::string name,int lo,int hi);
 
-  HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,call);
+  hpx::future<ptr_type> get_range(std::string name,int lo,int hi) {
+    if(opts.actor) {
+      Holder hlo, hhi;
+      hlo.var = double(lo);
+      hhi.var = double(hi);
+      return post(op_get_range,std::vector<std::string>{name},ptr_type(new std::vector<Holder>{hlo,hhi}));
+    }
+    return hpx::make_ready_future(get_range_now(name,lo,hi));
+  }
+
+  HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,get_range);
+
+  ptr_type set_range_now(std::string name,int lo,Holder values);
+
+  hpx::future<ptr_type> set_range(std::string name,int lo,Holder values) {
+    if(opts.actor) {
+      Holder hlo;
+      hlo.var = double(lo);
+      return post(op_set_range,std::vector<std::string>{name},ptr_type(new std::vector<Holder>{hlo,values}));
+    }
+    return hpx::make_ready_future(set_range_now(name,lo,values));
+  }
+
+  HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,set_range);
+
+  void set_async(std::string name,Holder h) {
+    if(opts.actor) {
+      post(op_set,std::vector<std::string>{name},ptr_type(new std::vector<Holder>{h}));
+      return;
+    }
+    set_many_now(std::vector<std::string>{name},std::vector<Holder>{h});
+  }
+
+  HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,set_async);
+
+  bool find_method(closure_ptr& cp);
+
+  void push_method(lua_State *L,closure_ptr& cp);
+
+  ptr_type call_now(closure_ptr cp,ptr_type ptargs);
+
+  hpx::future<ptr_type> call(closure_ptr cp,ptr_type ptargs) {
+    if(opts.actor)
+      return post(op_call,std::vector<std::string>(),ptargs,cp);
+    return hpx::make_ready_future(call_now(cp,ptargs));
+  }
+
+  // Runs arbitrary Lua, so it gets its own HPX thread and doesn't
+  // hold up the parcel thread.
+  HPX_DEFINE_COMPONENT_ACTION(lua_component,call);
+
+  // For short calls, when the cost of a new thread matters more
+  hpx::future<ptr_type> call_direct(closure_ptr cp,ptr_type ptargs) {
+    return call(cp,ptargs);
+  }
+
+  HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,call_direct);
+
+  // Queue a request for the drain task, the future has its result
+  hpx::future<ptr_type> post(int op,std::vector<std::string> names,ptr_type args,
+    closure_ptr cp = closure_ptr(new Closure()));
+
+  void drain();
+
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int)
+    {
+      boost::uint64_t v = this->version.load();
+      ar & tp;
+      ar & opts;
+      ar & v;
+      this->version = v;
+    }
 };
 
+}
+
+// Must be seen before the actions are first sent, below
+#if defined(HPX_HAVE_PARCEL_COALESCING)
+HPX_ACTION_USES_MESSAGE_COALESCING(hpx::lua_component::get_action);
+HPX_ACTION_USES_MESSAGE_COALESCING(hpx::lua_component::set_action);
+HPX_ACTION_USES_MESSAGE_COALESCING(hpx::lua_component::set_async_action);
+HPX_ACTION_USES_MESSAGE_COALESCING(hpx::lua_component::set_many_action);
+HPX_ACTION_USES_MESSAGE_COALESCING(hpx::lua_component::call_action);
+#endif
+
+namespace hpx
+{
+
 struct lua_client
   : hpx::components::client_base<lua_client, lua_component>
 {
@@ -71,66 +287,467 @@ struct lua_client
   }
 };
 
+void invalidate_read_cache(const lua_aux_client& client);
+
 hpx::future<ptr_type> lua_aux_client::get(std::string name)
 {
   lua_component::get_action act;
   return hpx::async(act, id, name);
 }
 
+hpx::future<ptr_type> lua_aux_client::get_if_changed(std::string name,double known_version)
+{
+  lua_component::get_if_changed_action act;
+  return hpx::async(act, id, name, known_version);
+}
+
 hpx::future<ptr_type> lua_aux_client::call(closure_ptr cp,ptr_type ptargs)
 {
+  return call(cp, ptargs, direct_calls);
+}
+
+hpx::future<ptr_type> lua_aux_client::call(closure_ptr cp,ptr_type ptargs,bool direct)
+{
+  invalidate_read_cache(*this);
+  if(direct) {
+    lua_component::call_direct_action act;
+    return hpx::async(act, id, cp, ptargs);
+  }
   lua_component::call_action act;
   return hpx::async(act, id, cp, ptargs);
 }
 
 hpx::future<ptr_type> lua_aux_client::set(std::string name,Holder h) {
+  invalidate_read_cache(*this);
   lua_component::set_action act;
   return hpx::async(act, id, name, h);
 }
 
-ptr_type lua_component::call(closure_ptr cp,ptr_type ptargs) {
-  ptr_type pt{new std::vector<Holder>};
-  bool found = false;
-  if(is_bytecode(cp->code.data)) {
-    found = true;
-  } else {
-    Holder hbyte = (tp->t)[cp->code.data];
-    if(hbyte.var.which() == Holder::bytecode_t) {
-      cp->code = boost::get<Bytecode>(hbyte.var);
-      found = true;
-    } else if(hbyte.var.which() == Holder::closure_t) {
-      cp = boost::get<closure_ptr>(hbyte.var);
-      found = true;
-    } else {
-      std::cout << "Which = " << hbyte.var.which() << " code=" << cp->code.data << std::endl;
+hpx::future<ptr_type> lua_aux_client::get_many(std::vector<std::string> names) {
+  lua_component::get_many_action act;
+  return hpx::async(act, id, names);
+}
+
+hpx::future<ptr_type> lua_aux_client::set_many(std::vector<std::string> names,std::vector<Holder> values) {
+  invalidate_read_cache(*this);
+  lua_component::set_many_action act;
+  return hpx::async(act, id, names, values);
+}
+
+hpx::future<ptr_type> lua_aux_client::get_range(std::string name,int lo,int hi) {
+  lua_component::get_range_action act;
+  return hpx::async(act, id, name, lo, hi);
+}
+
+hpx::future<ptr_type> lua_aux_client::set_range(std::string name,int lo,Holder values) {
+  invalidate_read_cache(*this);
+  lua_component::set_range_action act;
+  return hpx::async(act, id, name, lo, values);
+}
+
+void lua_aux_client::set_async(std::string name,Holder h) {
+  invalidate_read_cache(*this);
+  lua_component::set_async_action act;
+  hpx::apply(act, id, name, h);
+}
+
+//--- Client side write combining. SetBuffered() writes are kept here,
+//--- the last write to a key wins, and go out in one set_many action
+//--- on Flush() or wait_all(). The buffers are per locality, so
+//--- wait_all() sends and waits for all of them.
+struct write_buffer {
+  lua_aux_client client;
+  std::map<std::string,Holder> writes;
+};
+std::map<hpx::naming::gid_type,write_buffer> write_buffers;
+hpx::lcos::local::spinlock write_buffers_mtx;
+
+future_type flush_buffer(write_buffer& wb) {
+  std::vector<std::string> names;
+  std::vector<Holder> values;
+  for(auto i=wb.writes.begin();i != wb.writes.end();++i) {
+    names.push_back(i->first);
+    values.push_back(i->second);
+  }
+  return wb.client.set_many(names,values);
+}
+
+//--- Flush the writes buffered for one component. Returns false if
+//--- there were none.
+bool flush_write_buffer(const lua_aux_client& client,future_type& f) {
+  write_buffer wb;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(write_buffers_mtx);
+    auto search = write_buffers.find(client.id.get_gid());
+    if(search == write_buffers.end())
+      return false;
+    wb = search->second;
+    write_buffers.erase(search);
+  }
+  f = flush_buffer(wb);
+  return true;
+}
+
+void flush_write_buffers(std::vector<future_type>& futs) {
+  std::map<hpx::naming::gid_type,write_buffer> wbs;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(write_buffers_mtx);
+    if(write_buffers.empty())
+      return;
+    wbs.swap(write_buffers);
+  }
+  for(auto i=wbs.begin();i != wbs.end();++i)
+    futs.push_back(flush_buffer(i->second));
+}
+
+//--- Client side read cache for GetCached(). A value is served from
+//--- here until its lease runs out, then revalidated with the
+//--- component's version, which only transfers the value if the
+//--- component was written since. Writes through this locality drop
+//--- the cached values of that component right away.
+typedef std::chrono::steady_clock cache_clock;
+
+struct cache_entry {
+  Holder value;
+  double version;
+  cache_clock::time_point expires;
+};
+
+//--- The epoch counts invalidations, so a revalidation that was in
+//--- flight during one doesn't store what it got
+struct cache_component {
+  std::map<std::string,cache_entry> entries;
+  boost::uint64_t epoch = 0;
+};
+std::map<hpx::naming::gid_type,cache_component> read_cache;
+hpx::lcos::local::spinlock read_cache_mtx;
+
+void invalidate_read_cache(const lua_aux_client& client) {
+  std::lock_guard<hpx::lcos::local::spinlock> lock(read_cache_mtx);
+  auto search = read_cache.find(client.id.get_gid());
+  if(search != read_cache.end()) {
+    search->second.entries.clear();
+    ++search->second.epoch;
+  }
+}
+
+int default_lease_ms() {
+  static int lease = config_int("xlua.cache.lease_ms",100);
+  return lease;
+}
+
+ptr_type update_read_cache(hpx::naming::gid_type gid,std::string name,Holder cached,
+    int lease_ms,boost::uint64_t epoch,future_type f) {
+  ptr_type res = f.get();
+  ptr_type pt{new std::vector<Holder>()};
+  if(res->size() == 0)
+    return pt;
+  cache_entry ce;
+  ce.version = boost::get<double>((*res)[0].var);
+  ce.value = res->size() > 1 ? (*res)[1] : cached;
+  ce.expires = cache_clock::now() + std::chrono::milliseconds(lease_ms);
+  pt->push_back(ce.value);
+  std::lock_guard<hpx::lcos::local::spinlock> lock(read_cache_mtx);
+  cache_component& cc = read_cache[gid];
+  if(cc.epoch == epoch)
+    cc.entries[name] = ce;
+  return pt;
+}
+
+future_type get_cached(lua_aux_client& client,std::string name,int lease_ms) {
+  double known_version = 0;
+  Holder cached;
+  boost::uint64_t epoch = 0;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(read_cache_mtx);
+    auto search = read_cache.find(client.id.get_gid());
+    if(search != read_cache.end()) {
+      epoch = search->second.epoch;
+      auto entry = search->second.entries.find(name);
+      if(entry != search->second.entries.end()) {
+        if(cache_clock::now() < entry->second.expires) {
+          ptr_type pt{new std::vector<Holder>()};
+          pt->push_back(entry->second.value);
+          return hpx::make_ready_future(pt);
+        }
+        known_version = entry->second.version;
+        cached = entry->second.value;
+      }
     }
   }
-  if(found) {
-    LuaEnv lenv;
-    lua_State *L = lenv.get_state();
-    lua_pop(L,lua_gettop(L));
+  return client.get_if_changed(name,known_version).then(
+    boost::bind(update_read_cache,client.id.get_gid(),name,cached,lease_ms,epoch,_1));
+}
+
+//--- A name refers to a function stored in the component
+bool lua_component::find_method(closure_ptr& cp) {
+  if(is_bytecode(cp->code.data))
+    return true;
+  Holder hbyte = (tp->t)[cp->code.data];
+  if(hbyte.var.which() == Holder::bytecode_t) {
+    cp->code = boost::get<Bytecode>(hbyte.var);
+    return true;
+  } else if(hbyte.var.which() == Holder::closure_t) {
+    cp = boost::get<closure_ptr>(hbyte.var);
+    return true;
+  }
+  std::cout << "Which = " << hbyte.var.which() << " code=" << cp->code.data << std::endl;
+  return false;
+}
+
+//--- Push the function and the component's table. The dedicated VM
+//--- keeps both in its registry, loaded functions keyed by bytecode.
+void lua_component::push_method(lua_State *L,closure_ptr& cp) {
+  if(vm.get() == nullptr || L != vm->get_state()) {
     lua_load(L,(lua_Reader)lua_read,(void *)&cp->code.data,0,"b");
     new_table(L);
     table_ptr *ntp = (table_ptr *)lua_touserdata(L,-1);
     *ntp = tp;
-    for(auto it=ptargs->begin();it != ptargs->end();++it) {
-      it->unpack(L);
+    return;
+  }
+  lua_getfield(L,LUA_REGISTRYINDEX,"xlua_methods");
+  if(lua_isnil(L,-1) || cached_methods >= max_cached_methods) {
+    lua_pop(L,1);
+    lua_newtable(L);
+    lua_pushvalue(L,-1);
+    lua_setfield(L,LUA_REGISTRYINDEX,"xlua_methods");
+    cached_methods = 0;
+  }
+  lua_pushlstring(L,cp->code.data.c_str(),cp->code.data.size());
+  lua_rawget(L,-2);
+  if(!lua_isfunction(L,-1)) {
+    lua_pop(L,1);
+    lua_load(L,(lua_Reader)lua_read,(void *)&cp->code.data,0,"b");
+    lua_pushlstring(L,cp->code.data.c_str(),cp->code.data.size());
+    lua_pushvalue(L,-2);
+    lua_rawset(L,-4);
+    cached_methods++;
+  }
+  lua_remove(L,-2);
+  lua_getfield(L,LUA_REGISTRYINDEX,"xlua_self");
+  if(lua_isnil(L,-1)) {
+    lua_pop(L,1);
+    new_table(L);
+    table_ptr *ntp = (table_ptr *)lua_touserdata(L,-1);
+    *ntp = tp;
+    lua_pushvalue(L,-1);
+    lua_setfield(L,LUA_REGISTRYINDEX,"xlua_self");
+  }
+}
+
+ptr_type call_method(lua_component *c,lua_State *L,closure_ptr cp,ptr_type ptargs) {
+  ptr_type pt{new std::vector<Holder>};
+  lua_pop(L,lua_gettop(L));
+  c->push_method(L,cp);
+  for(auto it=ptargs->begin();it != ptargs->end();++it) {
+    it->unpack(L);
+  }
+  if(lua_pcall(L,lua_gettop(L)-1,10,0) != 0) {
+    SHOW_ERROR(L);
+  }
+  while(lua_gettop(L)>1 && lua_isnil(L,-1))
+    lua_pop(L,1);
+  int nargs = lua_gettop(L);
+  for(int i=1;i<=nargs;i++) {
+    Holder h;
+    h.pack(L,i);
+    pt->push_back(h);
+  }
+  lua_pop(L,nargs);
+  return pt;
+}
+
+ptr_type lua_component::call_now(closure_ptr cp,ptr_type ptargs) {
+  if(!find_method(cp))
+    return ptr_type(new std::vector<Holder>);
+  if(opts.dedicated) {
+    // If another call has the dedicated VM, don't wait for it
+    std::unique_lock<hpx::lcos::local::mutex> lock(vm_mtx,std::try_to_lock);
+    if(lock.owns_lock()) {
+      if(vm.get() == nullptr)
+        vm.reset(new Lua());
+      vm->sync_registry();
+      ptr_type pt = call_method(this,vm->get_state(),cp,ptargs);
+      ++version;
+      return pt;
     }
-    if(lua_pcall(L,lua_gettop(L)-1,10,0) != 0) {
-      SHOW_ERROR(L);
+  }
+  LuaEnv lenv;
+  ptr_type pt = call_method(this,lenv.get_state(),cp,ptargs);
+  // The method may have written to the table
+  ++version;
+  return pt;
+}
+
+//--- Copy out elements lo..hi, so only that part goes over the wire.
+//--- Vectors and tables both count from 1.
+ptr_type lua_component::get_range_now(std::string name,int lo,int hi) {
+  ptr_type pt{new std::vector<Holder>()};
+  Holder h = (tp->t)[name];
+  if(lo < 1)
+    lo = 1;
+  if(h.var.which() == Holder::vector_t) {
+    vector_ptr& v = boost::get<vector_ptr>(h.var);
+    int n = v->size();
+    if(hi > n-1)
+      hi = n-1;
+    vector_ptr res{new std::vector<double>(1)};
+    if(lo <= hi)
+      res->insert(res->end(),v->begin()+lo,v->begin()+hi+1);
+    Holder hr;
+    hr.var = res;
+    pt->push_back(hr);
+  } else if(h.var.which() == Holder::table_t) {
+    table_ptr& t = boost::get<table_ptr>(h.var);
+    table_ptr res{new table_inner()};
+    for(int i=lo;i<=hi;i++) {
+      auto search = t->t.find(double(i));
+      if(search == t->t.end())
+        continue;
+      double key = i-lo+1;
+      res->t[key] = search->second;
+      if(key == 1 + res->size)
+        res->size = key;
     }
-    while(lua_gettop(L)>1 && lua_isnil(L,-1))
-      lua_pop(L,1);
-    int nargs = lua_gettop(L);
-    for(int i=1;i<=nargs;i++) {
-      Holder h;
-      h.pack(L,i);
-      pt->push_back(h);
+    Holder hr;
+    hr.var = res;
+    pt->push_back(hr);
+  }
+  return pt;
+}
+
+//--- Write values into the field starting at lo. A missing field
+//--- becomes a vector or table, matching the values.
+ptr_type lua_component::set_range_now(std::string name,int lo,Holder values) {
+  ptr_type pt{new std::vector<Holder>()};
+  Holder& h = (tp->t)[name];
+  if(lo < 1)
+    lo = 1;
+  if(values.var.which() == Holder::vector_t) {
+    vector_ptr& src = boost::get<vector_ptr>(values.var);
+    if(h.var.which() == Holder::empty_t)
+      h.var = vector_ptr(new std::vector<double>());
+    if(h.var.which() == Holder::vector_t) {
+      vector_ptr& v = boost::get<vector_ptr>(h.var);
+      int n = src->size()-1;
+      if(v->size() < std::size_t(lo+n))
+        v->resize(lo+n);
+      for(int i=1;i<=n;i++)
+        (*v)[lo+i-1] = (*src)[i];
+    } else if(h.var.which() == Holder::table_t) {
+      table_ptr& t = boost::get<table_ptr>(h.var);
+      for(std::size_t i=1;i<src->size();i++) {
+        double key = lo+i-1;
+        t->t[key].var = (*src)[i];
+        if(key == 1 + t->size)
+          t->size = key;
+      }
+    }
+  } else if(values.var.which() == Holder::table_t) {
+    table_ptr& src = boost::get<table_ptr>(values.var);
+    if(h.var.which() == Holder::empty_t)
+      h.var = table_ptr(new table_inner());
+    if(h.var.which() == Holder::table_t) {
+      table_ptr& t = boost::get<table_ptr>(h.var);
+      for(int i=1;i<=src->size;i++) {
+        double key = lo+i-1;
+        t->t[key] = src->t[double(i)];
+        if(key == 1 + t->size)
+          t->size = key;
+      }
+    } else if(h.var.which() == Holder::vector_t) {
+      vector_ptr& v = boost::get<vector_ptr>(h.var);
+      int n = src->size;
+      if(v->size() < std::size_t(lo+n))
+        v->resize(lo+n);
+      for(int i=1;i<=n;i++) {
+        Holder& e = src->t[double(i)];
+        if(e.var.which() == Holder::num_t)
+          (*v)[lo+i-1] = boost::get<double>(e.var);
+      }
     }
   }
+  ++version;
   return pt;
 }
 
+//--- The id keeps the component alive until the drain is done, and
+//--- the pins taken by post() keep it from migrating away
+void drain_mailbox(lua_component *c,hpx::naming::id_type keep_alive) {
+  c->drain();
+}
+
+//--- Queue the request and make sure a drain task is running. Each
+//--- queued request pins the component until it has run.
+hpx::future<ptr_type> lua_component::post(int op,std::vector<std::string> names,ptr_type args,
+    closure_ptr cp) {
+  mailbox_item *item = new mailbox_item;
+  item->op = op;
+  item->cp = cp;
+  item->names.swap(names);
+  item->args = args;
+  hpx::future<ptr_type> f = item->done.get_future();
+  this->pin();
+  mailbox.push(item);
+  if(!scheduled.exchange(true))
+    hpx::apply(&drain_mailbox,this,this->get_id());
+  return f;
+}
+
+//--- Run everything in the mailbox back to back. The VM is only
+//--- acquired once, for the first call, and kept until it's empty.
+void lua_component::drain() {
+  std::unique_ptr<LuaEnv> lenv;
+  std::unique_lock<hpx::lcos::local::mutex> lock(vm_mtx,std::defer_lock);
+  lua_State *L = nullptr;
+  mailbox_item *item;
+  do {
+    while(mailbox.pop(item)) {
+      try {
+        ptr_type pt;
+        if(item->op == op_get) {
+          pt = get_many_now(item->names);
+        } else if(item->op == op_get_if_changed) {
+          pt = get_if_changed_now(item->names[0],boost::get<double>((*item->args)[0].var));
+        } else if(item->op == op_get_range) {
+          pt = get_range_now(item->names[0],int(boost::get<double>((*item->args)[0].var)),
+            int(boost::get<double>((*item->args)[1].var)));
+        } else if(item->op == op_set_range) {
+          pt = set_range_now(item->names[0],int(boost::get<double>((*item->args)[0].var)),
+            (*item->args)[1]);
+        } else if(item->op == op_set) {
+          pt = set_many_now(item->names,*item->args);
+        } else if(find_method(item->cp)) {
+          if(L == nullptr) {
+            if(opts.dedicated) {
+              lock.lock();
+              if(vm.get() == nullptr)
+                vm.reset(new Lua());
+              vm->sync_registry();
+              L = vm->get_state();
+            } else {
+              lenv.reset(new LuaEnv());
+              L = lenv->get_state();
+            }
+          }
+          pt = call_method(this,L,item->cp,item->args);
+          ++version;
+        } else {
+          pt.reset(new std::vector<Holder>);
+        }
+        item->done.set_value(pt);
+      } catch(...) {
+        item->done.set_exception(boost::current_exception());
+      }
+      delete item;
+      this->unpin();
+    }
+    scheduled.store(false);
+    // Something may have arrived after the last pop, but before
+    // the flag was cleared
+  } while(!mailbox.empty() && !scheduled.exchange(true));
+}
+
 int new_component(lua_State *L) {
   size_t nbytes = sizeof(lua_aux_client); 
   char *mem = (char *)lua_newuserdata(L, nbytes);
@@ -139,17 +756,52 @@ int new_component(lua_State *L) {
   return 1;
 }
 
+component_options get_component_options(lua_State *L,int index) {
+  component_options opts;
+  if(!lua_istable(L,index))
+    return opts;
+  lua_getfield(L,index,"dedicated");
+  opts.dedicated = lua_toboolean(L,-1);
+  lua_pop(L,1);
+  lua_getfield(L,index,"direct");
+  opts.direct = lua_toboolean(L,-1);
+  lua_pop(L,1);
+  lua_getfield(L,index,"actor");
+  opts.actor = lua_toboolean(L,-1);
+  lua_pop(L,1);
+  return opts;
+}
+
+//--- A component with default options, for C++ callers
+lua_aux_client new_lua_component(const hpx::naming::id_type& loc) {
+  lua_aux_client c;
+  lua_client lc = hpx::new_<lua_client>(loc,component_options());
+  c.id = lc.get_id();
+  return c;
+}
+
+//--- component.new(loc) or component.new(loc,{dedicated=true,...})
+//--- Options are dedicated, direct and actor. Without a locality the
+//--- component goes to the least loaded one.
 int create_component(lua_State *L) {
-  if(cmp_meta(L,-1,locality_metatable_name)) {
-    locality_type *loc = (locality_type *)lua_touserdata(L,-1);
-    lua_pop(L,1);
-    new_component(L);
-    lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-1);
-    lua_client lc = hpx::new_<lua_client>(*loc);
-    lcp->id = lc.get_id();
-    return lua_gettop(L);
+  hpx::naming::id_type loc;
+  component_options opts;
+  if(cmp_meta(L,1,locality_metatable_name)) {
+    loc = *(locality_type *)lua_touserdata(L,1);
+    opts = get_component_options(L,2);
+  } else if(lua_gettop(L)==0 || lua_istable(L,1)) {
+    loc = least_loaded_locality();
+    opts = get_component_options(L,1);
+  } else {
+    return 0;
   }
-  return 0;
+  lua_pop(L,lua_gettop(L));
+  new_component(L);
+  lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-1);
+  lua_client lc = hpx::new_<lua_client>(loc,opts);
+  lcp->id = lc.get_id();
+  lcp->direct_calls = opts.direct;
+  return lua_gettop(L);
 }
 
 int hpx_component_clean(lua_State *L) {
@@ -160,6 +812,24 @@ int hpx_component_clean(lua_State *L) {
     return 0;
 }
 
+//--- Send a request to a component once the writes buffered for it
+//--- are flushed, so it sees them. Nothing waits, the request is
+//--- chained to the flush.
+future_type after_flush(const lua_aux_client& client,
+    boost::function<hpx::future<ptr_type>()> request) {
+  future_type f;
+  if(!flush_write_buffer(client,f))
+    return request();
+  hpx::future<ptr_type> r = f.then([request](future_type) { return request(); });
+  return r;
+}
+
+//--- Reads see the buffered writes of this component
+future_type get_many_flushed(lua_aux_client& client,std::vector<std::string>& names) {
+  lua_aux_client c = client;
+  return after_flush(client,[c,names]() mutable { return c.get_many(names); });
+}
+
 int lua_client_get(lua_State *L) {
     if(lua_isstring(L,-1) && cmp_meta(L,-2,lua_client_metatable_name)) {
       lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-2);
@@ -168,12 +838,184 @@ int lua_client_get(lua_State *L) {
       new_future(L);
       future_type *fc =
         (future_type *)lua_touserdata(L,-1);
-      *fc = lcp->get(key);
+      lua_aux_client c = *lcp;
+      *fc = after_flush(c,[c,key]() mutable { return c.get(key); });
       return lua_gettop(L);
     }
     return 0;
 }
 
+//--- c:GetCached(key[,lease_ms]) for read-mostly data. Writes from
+//--- other localities show up once the lease runs out, buffered
+//--- writes once they are flushed. Writes into c:Local() are never
+//--- seen, they don't change the component's version.
+int lua_client_get_cached(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      CHECK_STRING(2,"GetCached")
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      std::string key = lua_tostring(L,2);
+      int lease_ms = default_lease_ms();
+      if(lua_isnumber(L,3))
+        lease_ms = lua_tointeger(L,3);
+      lua_pop(L,lua_gettop(L));
+      new_future(L);
+      future_type *fc =
+        (future_type *)lua_touserdata(L,-1);
+      *fc = get_cached(*lcp,key,lease_ms);
+      return 1;
+    }
+    return 0;
+}
+
+//--- c:GetRange(key,lo,hi), e.g. one halo cell of a remote vector
+int lua_client_get_range(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      CHECK_STRING(2,"GetRange")
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      std::string key = lua_tostring(L,2);
+      int lo = lua_tointeger(L,3);
+      int hi = lua_isnumber(L,4) ? lua_tointeger(L,4) : lo;
+      lua_pop(L,lua_gettop(L));
+      new_future(L);
+      future_type *fc =
+        (future_type *)lua_touserdata(L,-1);
+      lua_aux_client c = *lcp;
+      *fc = after_flush(c,[c,key,lo,hi]() mutable { return c.get_range(key,lo,hi); });
+      return 1;
+    }
+    return 0;
+}
+
+//--- c:SetRange(key,lo,values), values is a vector or table
+int lua_client_set_range(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      CHECK_STRING(2,"SetRange")
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      std::string key = lua_tostring(L,2);
+      int lo = lua_tointeger(L,3);
+      Holder h;
+      h.pack(L,4);
+      lua_pop(L,lua_gettop(L));
+      new_future(L);
+      future_type *fc =
+        (future_type *)lua_touserdata(L,-1);
+      *fc = lcp->set_range(key,lo,h);
+      return 1;
+    }
+    return 0;
+}
+
+//--- c:GetMany('a','b',...) or c:GetMany({'a','b',...})
+int lua_client_get_many(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      std::vector<std::string> names;
+      int nargs = lua_gettop(L);
+      if(nargs == 2 && lua_istable(L,2)) {
+        int n = luaL_len(L,2);
+        for(int i=1;i<=n;i++) {
+          lua_rawgeti(L,2,i);
+          if(!lua_isstring(L,-1)) {
+            luai_writestringerror("Argument to '%s' is not a string ","GetMany");
+            return 0;
+          }
+          names.push_back(lua_tostring(L,-1));
+          lua_pop(L,1);
+        }
+      } else {
+        for(int i=2;i<=nargs;i++) {
+          CHECK_STRING(i,"GetMany")
+          names.push_back(lua_tostring(L,i));
+        }
+      }
+      lua_pop(L,lua_gettop(L));
+      new_future(L);
+      future_type *fc =
+        (future_type *)lua_touserdata(L,-1);
+      *fc = get_many_flushed(*lcp,names);
+      return 1;
+    }
+    return 0;
+}
+
+//--- c:SetMany({a=1,b=2,...})
+int lua_client_set_many(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      Holder h;
+      h.pack(L,2);
+      if(h.var.which() != Holder::table_t) {
+        luai_writestringerror("Argument to '%s' is not a table ","SetMany");
+        return 0;
+      }
+      table_ptr tp = boost::get<table_ptr>(h.var);
+      std::vector<std::string> names;
+      std::vector<Holder> values;
+      for(auto i=tp->t.begin();i != tp->t.end();++i) {
+        if(i->first.which() != 1)
+          continue;
+        names.push_back(boost::get<std::string>(i->first));
+        values.push_back(i->second);
+      }
+      lua_pop(L,lua_gettop(L));
+      new_future(L);
+      future_type *fc =
+        (future_type *)lua_touserdata(L,-1);
+      *fc = lcp->set_many(names,values);
+      return 1;
+    }
+    return 0;
+}
+
+//--- c:SetAsync(key,value), nothing to wait for
+int lua_client_set_async(lua_State *L) {
+    if(lua_isstring(L,-2) && cmp_meta(L,-3,lua_client_metatable_name)) {
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-3);
+      std::string key = lua_tostring(L,-2);
+      Holder h;
+      h.pack(L,-1);
+      lcp->set_async(key,h);
+      lua_pop(L,lua_gettop(L));
+    }
+    return 0;
+}
+
+//--- c:SetBuffered(key,value), sent by c:Flush() or by any wait_all()
+//--- on this locality. wait_all() sends the buffers of every component,
+//--- not only of those whose futures it waits for.
+int lua_client_set_buffered(lua_State *L) {
+    if(lua_isstring(L,-2) && cmp_meta(L,-3,lua_client_metatable_name)) {
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-3);
+      std::string key = lua_tostring(L,-2);
+      Holder h;
+      h.pack(L,-1);
+      {
+        std::lock_guard<hpx::lcos::local::spinlock> lock(write_buffers_mtx);
+        write_buffer& wb = write_buffers[lcp->id.get_gid()];
+        wb.client = *lcp;
+        wb.writes[key] = h;
+      }
+      lua_pop(L,lua_gettop(L));
+    }
+    return 0;
+}
+
+int lua_client_flush(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      future_type f;
+      if(!flush_write_buffer(*lcp,f))
+        f = hpx::make_ready_future(ptr_type(new std::vector<Holder>()));
+      lua_pop(L,lua_gettop(L));
+      new_future(L);
+      future_type *fc =
+        (future_type *)lua_touserdata(L,-1);
+      *fc = f;
+      return 1;
+    }
+    return 0;
+}
+
 int lua_client_getid(lua_State *L) {
     if(cmp_meta(L,-1,lua_client_metatable_name)) {
       lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-1);
@@ -186,7 +1028,7 @@ int lua_client_getid(lua_State *L) {
     return 0;
 }
 
-int lua_client_call(lua_State *L) {
+int lua_client_call(lua_State *L,bool direct) {
     if(cmp_meta(L,1,lua_client_metatable_name)) {
       lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
       closure_ptr cp{new Closure()};
@@ -208,19 +1050,41 @@ int lua_client_call(lua_State *L) {
       new_future(L);
       future_type *fc =
         (future_type *)lua_touserdata(L,-1);
-      *fc = lcp->call(cp,pt);
+      // Buffered writes land before the call runs
+      lua_aux_client c = *lcp;
+      *fc = after_flush(c,[c,cp,pt,direct]() mutable { return c.call(cp,pt,direct); });
       return 1;
     }
     return 0;
 }
 
+//--- c:Call(f,...) runs the way the component was created,
+//--- CallDirect and CallScheduled pick for this one call.
+int lua_client_call(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      return lua_client_call(L,lcp->direct_calls);
+    }
+    return 0;
+}
+
+int lua_client_call_direct(lua_State *L) {
+    return lua_client_call(L,true);
+}
+
+int lua_client_call_scheduled(lua_State *L) {
+    return lua_client_call(L,false);
+}
+
 int lua_client_set(lua_State *L) {
     if(lua_isstring(L,-2) && cmp_meta(L,-3,lua_client_metatable_name)) {
       lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-3);
       std::string key = lua_tostring(L,-2);
       Holder h;
       h.pack(L,-1);
-      future_type ff = lcp->set(key,h);
+      // A buffered write to the same key mustn't land after this one
+      lua_aux_client c = *lcp;
+      future_type ff = after_flush(c,[c,key,h]() mutable { return c.set(key,h); });
       lua_pop(L,lua_gettop(L));
       new_future(L);
       future_type *fc =
@@ -231,6 +1095,63 @@ int lua_client_set(lua_State *L) {
     return 0;
 }
 
+//--- c:Local() is the component's own table if it lives here, so code
+//--- run next to it with async_at() can work on it without copies.
+//--- nil elsewhere, and for actor components, which own their table.
+//--- Writes into it bypass the component's version, so GetCached()
+//--- doesn't see them. Use Set() for keys read that way.
+int lua_client_local(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      hpx::naming::id_type id = lcp->id;
+      lua_pop(L,lua_gettop(L));
+      if(hpx::get_colocation_id_sync(id) != hpx::find_here()) {
+        lua_pushnil(L);
+        return 1;
+      }
+      auto c = hpx::get_ptr<lua_component>(id).get();
+      if(c->opts.actor) {
+        lua_pushnil(L);
+        return 1;
+      }
+      new_table(L);
+      table_ptr *tp = (table_ptr *)lua_touserdata(L,-1);
+      *tp = c->tp;
+      return 1;
+    }
+    return 0;
+}
+
+ptr_type migrated(hpx::future<hpx::naming::id_type> f) {
+  f.get();
+  return ptr_type(new std::vector<Holder>());
+}
+
+//--- c:Migrate(loc), or c:Migrate() to move to the least loaded
+//--- locality. The id stays valid, calls in flight are forwarded.
+int lua_client_migrate(lua_State *L) {
+    if(cmp_meta(L,1,lua_client_metatable_name)) {
+      lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
+      hpx::naming::id_type loc;
+      if(cmp_meta(L,2,locality_metatable_name))
+        loc = *(locality_type *)lua_touserdata(L,2);
+      else
+        loc = least_loaded_locality();
+      hpx::naming::id_type id = lcp->id;
+      lua_aux_client c = *lcp;
+      lua_pop(L,lua_gettop(L));
+      new_future(L);
+      future_type *fc =
+        (future_type *)lua_touserdata(L,-1);
+      // Writes buffered for it go out first
+      *fc = after_flush(c,[id,loc]() {
+        return hpx::components::migrate<lua_component>(id,loc).then(migrated);
+      });
+      return 1;
+    }
+    return 0;
+}
+
 int lua_client_name(lua_State *L) {
   lua_pushstring(L,lua_client_metatable_name);
   return 1;
@@ -241,8 +1162,20 @@ int open_component(lua_State *L) {
         {"Get",&lua_client_get},
         {"GetId",&lua_client_getid},
         {"Set",&lua_client_set},
+        {"GetMany",&lua_client_get_many},
+        {"GetCached",&lua_client_get_cached},
+        {"GetRange",&lua_client_get_range},
+        {"SetRange",&lua_client_set_range},
+        {"SetMany",&lua_client_set_many},
+        {"SetAsync",&lua_client_set_async},
+        {"SetBuffered",&lua_client_set_buffered},
+        {"Flush",&lua_client_flush},
         {"Name",&lua_client_name},
+        {"Migrate",&lua_client_migrate},
+        {"Local",&lua_client_local},
         {"Call",&lua_client_call},
+        {"CallDirect",&lua_client_call_direct},
+        {"CallScheduled",&lua_client_call_scheduled},
         {NULL,NULL},
     };
 
@@ -272,5 +1205,12 @@ typedef hpx::components::simple_component<hpx::lua_component> lua_component_type
 HPX_REGISTER_COMPONENT(lua_component_type,lua_component);
 
 HPX_REGISTER_ACTION(hpx::lua_component::get_action);
+HPX_REGISTER_ACTION(hpx::lua_component::get_if_changed_action);
 HPX_REGISTER_ACTION(hpx::lua_component::set_action);
+HPX_REGISTER_ACTION(hpx::lua_component::get_many_action);
+HPX_REGISTER_ACTION(hpx::lua_component::set_many_action);
+HPX_REGISTER_ACTION(hpx::lua_component::set_async_action);
+HPX_REGISTER_ACTION(hpx::lua_component::get_range_action);
+HPX_REGISTER_ACTION(hpx::lua_component::set_range_action);
 HPX_REGISTER_ACTION(hpx::lua_component::call_action);
+HPX_REGISTER_ACTION(hpx::lua_component::call_direct_action);
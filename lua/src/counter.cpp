@@ -1,6 +1,13 @@
 #include "xlua.hpp"
 #include "xlua_prototypes.hpp"
 #include <hpx/include/performance_counters.hpp>
+#include <hpx/lcos/local/spinlock.hpp>
+#if HPX_VERSION_FULL >= 0x010000
+#include <hpx/runtime/config_entry.hpp>
+#endif
+#include <chrono>
+#include <mutex>
+#include <sstream>
 
 namespace hpx {
 
@@ -75,6 +82,185 @@ int xlua_stop(lua_State *L) {
   return 0;
 }
 
+//--- Counters owned by xlua, e.g. /xlua/gc/time
+void install_xlua_counters() {
+  hpx::performance_counters::install_counter_type(
+    "/xlua/gc/time",&get_gc_time,
+    "returns the time spent in idle-time garbage collection steps","ns");
+  hpx::performance_counters::install_counter_type(
+    "/xlua/gc/steps",&get_gc_steps,
+    "returns the number of idle-time garbage collection steps");
+}
+
+struct install_xlua_counters_at_startup {
+  install_xlua_counters_at_startup() {
+    hpx::register_startup_function(&install_xlua_counters);
+  }
+} install_xlua_counters_at_startup_;
+
+//--- Queue length counters of each locality, looked up once
+std::map<boost::uint32_t,hpx::naming::id_type> queue_counters;
+hpx::lcos::local::spinlock queue_counters_mtx;
+
+hpx::naming::id_type get_queue_counter(boost::uint32_t locality_id) {
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(queue_counters_mtx);
+    auto search = queue_counters.find(locality_id);
+    if(search != queue_counters.end())
+      return search->second;
+  }
+  std::ostringstream name;
+  name << "/threadqueue{locality#" << locality_id << "/total}/length";
+  hpx::error_code ec;
+  hpx::naming::id_type id = hpx::performance_counters::get_counter(name.str(),ec);
+  if(ec)
+    return hpx::naming::invalid_id;
+  std::lock_guard<hpx::lcos::local::spinlock> lock(queue_counters_mtx);
+  queue_counters[locality_id] = id;
+  return id;
+}
+
+//--- The locality with the fewest queued threads. Falls back to
+//--- here if the counters can't be read.
+hpx::naming::id_type query_least_loaded() {
+  std::vector<hpx::naming::id_type> locs = hpx::find_all_localities();
+  if(locs.size() < 2)
+    return hpx::find_here();
+  std::vector<std::size_t> which;
+  std::vector<hpx::future<hpx::performance_counters::counter_value> > values;
+  for(std::size_t i=0;i<locs.size();i++) {
+    hpx::naming::id_type id =
+      get_queue_counter(hpx::naming::get_locality_id_from_id(locs[i]));
+    if(!id)
+      continue;
+    which.push_back(i);
+    values.push_back(
+      hpx::performance_counters::stubs::performance_counter::get_value_async(id));
+  }
+  hpx::wait_all(values);
+  hpx::naming::id_type best = hpx::find_here();
+  boost::int64_t best_len = -1;
+  for(std::size_t i=0;i<values.size();i++) {
+    if(values[i].has_exception())
+      continue;
+    boost::int64_t len = values[i].get().value_;
+    if(best_len < 0 || len < best_len) {
+      best_len = len;
+      best = locs[which[i]];
+    }
+  }
+  return best;
+}
+
+//--- The last answer of query_least_loaded(). Once it is older than
+//--- xlua.placement.ttl_ms a new query starts in the background, the
+//--- caller gets the old answer and never waits for the counters.
+struct load_cache {
+  hpx::lcos::local::spinlock mtx;
+  hpx::naming::id_type best;
+  std::chrono::steady_clock::time_point expires;
+  bool refreshing = false;
+};
+load_cache least_loaded_cache;
+
+void refresh_least_loaded() {
+  static int ttl_ms = config_int("xlua.placement.ttl_ms",500);
+  hpx::naming::id_type best;
+  try {
+    best = query_least_loaded();
+  } catch(...) {
+    best = hpx::find_here();
+  }
+  std::lock_guard<hpx::lcos::local::spinlock> lock(least_loaded_cache.mtx);
+  least_loaded_cache.best = best;
+  least_loaded_cache.expires =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl_ms);
+  least_loaded_cache.refreshing = false;
+}
+
+hpx::naming::id_type least_loaded_locality() {
+  if(hpx::find_all_localities().size() < 2)
+    return hpx::find_here();
+  hpx::naming::id_type best;
+  bool refresh = false;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(least_loaded_cache.mtx);
+    best = least_loaded_cache.best;
+    if(!least_loaded_cache.refreshing &&
+        (!best || std::chrono::steady_clock::now() >= least_loaded_cache.expires)) {
+      least_loaded_cache.refreshing = true;
+      refresh = true;
+    }
+  }
+  if(refresh)
+    hpx::apply(refresh_least_loaded);
+  // Until the first answer is in, place here
+  return best ? best : hpx::find_here();
+}
+
+int xlua_least_loaded(lua_State *L) {
+  hpx::naming::id_type id = least_loaded_locality();
+  new_locality(L);
+  hpx::naming::id_type *loc = (hpx::naming::id_type *)lua_touserdata(L,-1);
+  *loc = id;
+  return 1;
+}
+
+boost::int64_t read_counter(const std::string& name) {
+  hpx::error_code ec;
+  hpx::naming::id_type id = hpx::performance_counters::get_counter(name,ec);
+  if(ec)
+    return -1;
+  return hpx::performance_counters::stubs::performance_counter::get_value(id).value_;
+}
+
+//--- hpx.coalescing_stats([action]) is {parcels=,messages=,ratio=} for
+//--- the coalesced parcels this locality sent with action, by default
+//--- luax_async_action. ratio is parcels per message, nil without
+//--- parcel coalescing.
+int xlua_coalescing_stats(lua_State *L) {
+  std::string action = "luax_async_action";
+  if(lua_isstring(L,1))
+    action = lua_tostring(L,1);
+  lua_pop(L,lua_gettop(L));
+  std::ostringstream prefix;
+  prefix << "/coalescing{locality#" << hpx::get_locality_id() << "/total}/count/";
+  boost::int64_t parcels = read_counter(prefix.str()+"parcels@"+action);
+  boost::int64_t messages = read_counter(prefix.str()+"messages@"+action);
+  if(parcels < 0 || messages < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L,0,3);
+  lua_pushnumber(L,parcels);
+  lua_setfield(L,-2,"parcels");
+  lua_pushnumber(L,messages);
+  lua_setfield(L,-2,"messages");
+  lua_pushnumber(L,messages > 0 ? double(parcels)/messages : 0);
+  lua_setfield(L,-2,"ratio");
+  return 1;
+}
+
+//--- hpx.set_coalescing(num_messages[,interval_us]). Older HPX versions
+//--- only read these at startup, from
+//--- --hpx:ini=hpx.plugins.coalescing_message_handlers.num_messages=N
+//--- --hpx:ini=hpx.plugins.coalescing_message_handlers.interval=T
+int xlua_set_coalescing(lua_State *L) {
+#if HPX_VERSION_FULL >= 0x010000
+  if(lua_isnumber(L,1))
+    hpx::set_config_entry("hpx.plugins.coalescing_message_handlers.num_messages",
+      std::to_string(lua_tointeger(L,1)));
+  if(lua_isnumber(L,2))
+    hpx::set_config_entry("hpx.plugins.coalescing_message_handlers.interval",
+      std::to_string(lua_tointeger(L,2)));
+#else
+  luai_writestringerror("'%s' needs HPX 1.0, set hpx.plugins.coalescing_message_handlers "
+    "on the command line instead ","set_coalescing");
+#endif
+  lua_pop(L,lua_gettop(L));
+  return 0;
+}
+
 int discover(lua_State *L) {
   new_table(L);
   table_ptr& tp = *(table_ptr *)lua_touserdata(L,-1);
@@ -0,0 +1,402 @@
+#include "xlua.hpp"
+#include "xlua_prototypes.hpp"
+
+namespace hpx {
+
+/**
+ * A vector of numbers spread over lua_components, one partition per
+ * component. Element i (from 1) lives in block (i-1)/block, and block
+ * k lives in partition k % #parts. A block policy is one block per
+ * partition, cyclic is blocks of one.
+ *
+ * Every partition keeps its elements as a vector_t in its "data"
+ * field, so it can also be used like any other component.
+ */
+struct dvector_inner {
+  std::vector<lua_aux_client> parts;
+  std::vector<hpx::naming::id_type> locs;
+  int n = 0;
+  int block = 1;
+
+  int nparts() const {
+    return parts.size();
+  }
+
+  //--- Partition and offset in the partition (from 1) of element i
+  void locate(int i,int& part,int& off) const {
+    int blk = (i-1)/block;
+    part = blk % nparts();
+    off = (blk/nparts())*block + (i-1)%block + 1;
+  }
+
+  //--- Number of elements stored in partition p
+  int local_size(int p) const {
+    int nblocks = (n+block-1)/block;
+    int sz = 0;
+    for(int blk=p;blk<nblocks;blk+=nparts())
+      sz += (blk == nblocks-1) ? n - blk*block : block;
+    return sz;
+  }
+};
+typedef std::shared_ptr<dvector_inner> dvector_ptr;
+
+//--- Run on each partition. Gets the partition's table, the function,
+//--- and what's needed to go from a local to a global index.
+const char *dvector_foreach_src =
+  "local self,f,p,np,b = ...\n"
+  "local v = self.data\n"
+  "for j=1,#v do\n"
+  "  local gi = (math.floor((j-1)/b)*np + p)*b + (j-1)%b + 1\n"
+  "  local r = f(v[j],gi)\n"
+  "  if r ~= nil then v[j] = r end\n"
+  "end\n";
+
+const char *dvector_reduce_src =
+  "local self,f,init = ...\n"
+  "local v = self.data\n"
+  "local acc = init\n"
+  "for j=1,#v do acc = f(acc,v[j]) end\n"
+  "return acc\n";
+
+//--- The drivers are compiled once per process
+const std::string& dvector_foreach_code() {
+  static const std::string bytecode = compile_lua(dvector_foreach_src,"=dvector_foreach");
+  return bytecode;
+}
+
+const std::string& dvector_reduce_code() {
+  static const std::string bytecode = compile_lua(dvector_reduce_src,"=dvector_reduce");
+  return bytecode;
+}
+
+dvector_ptr *check_dvector(lua_State *L,int index) {
+  if(cmp_meta(L,index,dvector_metatable_name))
+    return (dvector_ptr *)lua_touserdata(L,index);
+  return nullptr;
+}
+
+int new_dvector_ud(lua_State *L) {
+  size_t nbytes = sizeof(dvector_ptr);
+  char *mem = (char *)lua_newuserdata(L,nbytes);
+  new (mem) dvector_ptr(new dvector_inner());
+  luaL_setmetatable(L,dvector_metatable_name);
+  return 1;
+}
+
+//--- dvector.new(n[,{policy='block'|'cyclic'|'block_cyclic',
+//---   block=k,localities={...}}])
+int new_dvector(lua_State *L) {
+  if(!lua_isnumber(L,1)) {
+    luai_writestringerror("Argument to '%s' is not a number ","dvector.new");
+    return 0;
+  }
+  int n = lua_tointeger(L,1);
+  std::string policy = "block";
+  int block = 1;
+  std::vector<hpx::naming::id_type> locs;
+  if(lua_istable(L,2)) {
+    lua_getfield(L,2,"policy");
+    if(lua_isstring(L,-1))
+      policy = lua_tostring(L,-1);
+    lua_pop(L,1);
+    lua_getfield(L,2,"block");
+    if(lua_isnumber(L,-1))
+      block = lua_tointeger(L,-1);
+    lua_pop(L,1);
+    lua_getfield(L,2,"localities");
+    if(lua_istable(L,-1)) {
+      int nl = luaL_len(L,-1);
+      for(int i=1;i<=nl;i++) {
+        lua_rawgeti(L,-1,i);
+        if(cmp_meta(L,-1,locality_metatable_name))
+          locs.push_back(*(locality_type *)lua_touserdata(L,-1));
+        lua_pop(L,1);
+      }
+    }
+    lua_pop(L,1);
+  }
+  if(locs.size() == 0)
+    locs = hpx::find_all_localities();
+  lua_pop(L,lua_gettop(L));
+
+  new_dvector_ud(L);
+  dvector_ptr& dv = *(dvector_ptr *)lua_touserdata(L,-1);
+  dv->n = n;
+  dv->locs = locs;
+  int np = locs.size();
+  if(policy == "cyclic")
+    dv->block = 1;
+  else if(policy == "block_cyclic")
+    dv->block = block < 1 ? 1 : block;
+  else
+    dv->block = n < np ? 1 : (n+np-1)/np;
+
+  std::vector<future_type> futs;
+  for(int p=0;p<np;p++) {
+    lua_aux_client c = new_lua_component(locs[p]);
+    dv->parts.push_back(c);
+    Holder h;
+    h.var = vector_ptr(new std::vector<double>(dv->local_size(p)+1));
+    futs.push_back(c.set("data",h));
+  }
+  // The partitions must exist before the first access
+  hpx::wait_all(futs);
+  return 1;
+}
+
+int dvector_len(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,1);
+  if(dv == nullptr)
+    return 0;
+  lua_pushnumber(L,(*dv)->n);
+  return 1;
+}
+
+ptr_type dvector_elem(future_type f) {
+  ptr_type p = f.get();
+  ptr_type pt{new std::vector<Holder>()};
+  if(p->size() > 0 && (*p)[0].var.which() == Holder::vector_t) {
+    vector_ptr& v = boost::get<vector_ptr>((*p)[0].var);
+    if(v->size() > 1) {
+      Holder h;
+      h.var = (*v)[1];
+      pt->push_back(h);
+    }
+  }
+  return pt;
+}
+
+//--- d:Get(i) returns a future of element i
+int dvector_get(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,1);
+  if(dv == nullptr || !lua_isnumber(L,2))
+    return 0;
+  int i = lua_tointeger(L,2);
+  lua_pop(L,lua_gettop(L));
+  if(i < 1 || i > (*dv)->n)
+    return 0;
+  int part, off;
+  (*dv)->locate(i,part,off);
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = (*dv)->parts[part].get_range("data",off,off).then(dvector_elem);
+  return 1;
+}
+
+//--- d:Set(i,x)
+int dvector_set(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,1);
+  if(dv == nullptr || !lua_isnumber(L,2) || !lua_isnumber(L,3))
+    return 0;
+  int i = lua_tointeger(L,2);
+  double x = lua_tonumber(L,3);
+  lua_pop(L,lua_gettop(L));
+  if(i < 1 || i > (*dv)->n)
+    return 0;
+  int part, off;
+  (*dv)->locate(i,part,off);
+  Holder h;
+  h.var = vector_ptr(new std::vector<double>{0,x});
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = (*dv)->parts[part].set_range("data",off,h);
+  return 1;
+}
+
+//--- d:Part(i) returns the component holding element i and the
+//--- element's index in its "data" field
+int dvector_part(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,1);
+  if(dv == nullptr || !lua_isnumber(L,2))
+    return 0;
+  int i = lua_tointeger(L,2);
+  lua_pop(L,lua_gettop(L));
+  if(i < 1 || i > (*dv)->n)
+    return 0;
+  int part, off;
+  (*dv)->locate(i,part,off);
+  new_component(L);
+  lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-1);
+  *lcp = (*dv)->parts[part];
+  lua_pushnumber(L,off);
+  return 2;
+}
+
+void push_parts(lua_State *L,dvector_ptr dv,bool local_only) {
+  hpx::naming::id_type here = hpx::find_here();
+  lua_newtable(L);
+  int k = 1;
+  for(int p=0;p<dv->nparts();p++) {
+    if(local_only && dv->locs[p] != here)
+      continue;
+    new_component(L);
+    lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-1);
+    *lcp = dv->parts[p];
+    lua_rawseti(L,-2,k++);
+  }
+}
+
+//--- d:Parts() all partitions, d:LocalParts() the ones on this locality
+int dvector_parts(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,1);
+  if(dv == nullptr)
+    return 0;
+  dvector_ptr d = *dv;
+  lua_pop(L,lua_gettop(L));
+  push_parts(L,d,false);
+  return 1;
+}
+
+int dvector_local_parts(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,1);
+  if(dv == nullptr)
+    return 0;
+  dvector_ptr d = *dv;
+  lua_pop(L,lua_gettop(L));
+  push_parts(L,d,true);
+  return 1;
+}
+
+ptr_type dvector_done(std::vector<future_type> futs) {
+  for(auto i=futs.begin();i != futs.end();++i)
+    i->get();
+  return ptr_type(new std::vector<Holder>());
+}
+
+//--- d:ForEach(f) replaces each element x at global index i with
+//--- f(x,i), if that isn't nil. Each partition runs where it lives.
+int dvector_for_each(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,1);
+  if(dv == nullptr || !lua_isfunction(L,2))
+    return 0;
+  dvector_ptr d = *dv;
+  Holder hf;
+  hf.pack(L,2);
+  lua_pop(L,lua_gettop(L));
+  closure_ptr cp{new Closure()};
+  cp->code.data = dvector_foreach_code();
+  std::vector<future_type> futs;
+  for(int p=0;p<d->nparts();p++) {
+    ptr_type args{new std::vector<Holder>()};
+    Holder hp, hnp, hb;
+    hp.var = double(p);
+    hnp.var = double(d->nparts());
+    hb.var = double(d->block);
+    args->push_back(hf);
+    args->push_back(hp);
+    args->push_back(hnp);
+    args->push_back(hb);
+    futs.push_back(d->parts[p].call(cp,args));
+  }
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = hpx::when_all(futs).then(hpx::util::unwrapped(boost::bind(dvector_done,_1)));
+  return 1;
+}
+
+//--- Fold the partial results of each partition with f, here
+ptr_type dvector_combine(Holder f,Holder init,std::vector<future_type> futs) {
+  LuaEnv lenv;
+  lua_State *L = lenv.get_state();
+  lua_pop(L,lua_gettop(L));
+  init.unpack(L);
+  for(auto i=futs.begin();i != futs.end();++i) {
+    ptr_type p = i->get();
+    if(p->size() == 0)
+      continue;
+    f.unpack(L);
+    lua_pushvalue(L,1);
+    (*p)[0].unpack(L);
+    if(lua_pcall(L,2,1,0) != 0) {
+      SHOW_ERROR(L);
+      break;
+    }
+    lua_replace(L,1);
+  }
+  ptr_type pt{new std::vector<Holder>()};
+  Holder h;
+  h.pack(L,1);
+  pt->push_back(h);
+  lua_pop(L,lua_gettop(L));
+  return pt;
+}
+
+//--- d:Reduce(f,init) returns a future of f(...f(f(init,x1),x2)...).
+//--- Each partition reduces its own elements, starting from init, so
+//--- f should be associative and init its identity.
+int dvector_reduce(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,1);
+  if(dv == nullptr || !lua_isfunction(L,2))
+    return 0;
+  dvector_ptr d = *dv;
+  Holder hf, hinit;
+  hf.pack(L,2);
+  hinit.pack(L,3);
+  lua_pop(L,lua_gettop(L));
+  closure_ptr cp{new Closure()};
+  cp->code.data = dvector_reduce_code();
+  std::vector<future_type> futs;
+  for(int p=0;p<d->nparts();p++) {
+    ptr_type args{new std::vector<Holder>()};
+    args->push_back(hf);
+    args->push_back(hinit);
+    futs.push_back(d->parts[p].call(cp,args));
+  }
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = hpx::when_all(futs).then(
+    hpx::util::unwrapped(boost::bind(dvector_combine,hf,hinit,_1)));
+  return 1;
+}
+
+int dvector_name(lua_State *L) {
+  lua_pushstring(L,dvector_metatable_name);
+  return 1;
+}
+
+int hpx_dvector_clean(lua_State *L) {
+  dvector_ptr *dv = check_dvector(L,-1);
+  if(dv != nullptr)
+    dtor(dv);
+  return 0;
+}
+
+int open_dvector(lua_State *L) {
+    static const struct luaL_Reg dvector_meta_funcs [] = {
+        {"Get",&dvector_get},
+        {"Set",&dvector_set},
+        {"Size",&dvector_len},
+        {"Part",&dvector_part},
+        {"Parts",&dvector_parts},
+        {"LocalParts",&dvector_local_parts},
+        {"ForEach",&dvector_for_each},
+        {"Reduce",&dvector_reduce},
+        {"Name",&dvector_name},
+        {NULL,NULL},
+    };
+
+    static const struct luaL_Reg dvector_funcs [] = {
+        {"new", &new_dvector},
+        {NULL, NULL}
+    };
+
+    luaL_newlib(L,dvector_funcs);
+
+    luaL_newmetatable(L,dvector_metatable_name);
+    luaL_newlib(L, dvector_meta_funcs);
+    lua_setfield(L,-2,"__index");
+
+    lua_pushstring(L,"__gc");
+    lua_pushcfunction(L,hpx_dvector_clean);
+    lua_settable(L,-3);
+
+    lua_pushstring(L,"__len");
+    lua_pushcfunction(L,dvector_len);
+    lua_settable(L,-3);
+
+    lua_pop(L,1);
+
+    return 1;
+}
+
+}
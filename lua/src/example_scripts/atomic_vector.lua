@@ -0,0 +1,43 @@
+--many tasks updating one vector_t at the same time
+
+ntasks = 8
+n = 1000
+
+v = vector_t.new()
+for i=1,5 do
+  v[i] = 0
+end
+v[2] = 1e9
+v[3] = -1e9
+
+futs = {}
+for t=1,ntasks do
+  futs[t] = async(function(t,v,n)
+    for i=1,n do
+      v:atomic_add(1,1)
+      v:atomic_min(2,t*n+i)
+      v:atomic_max(3,t*n+i)
+      --increment v[4] with compare_exchange, retrying on a race
+      local cur = v[4]
+      while true do
+        local ok,found = v:compare_exchange(4,cur,cur+1)
+        if ok then
+          break
+        end
+        cur = found
+      end
+      v:scatter_add({5,5},1)
+    end
+  end,t,v,n)
+end
+wait_all(futs)
+
+assert(v[1] == ntasks*n, 'atomic_add lost updates: '..v[1])
+assert(v[2] == n+1, 'atomic_min: '..v[2])
+assert(v[3] == ntasks*n+n, 'atomic_max: '..v[3])
+assert(v[4] == ntasks*n, 'compare_exchange lost updates: '..v[4])
+assert(v[5] == 2*ntasks*n, 'scatter_add lost updates: '..v[5])
+
+ok,found = v:compare_exchange(4,-1,0)
+assert(not ok and found == ntasks*n)
+print('atomic vector ops passed')
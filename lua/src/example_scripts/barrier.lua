@@ -0,0 +1,30 @@
+--tasks stepping in lock step, and a barrier across all localities
+
+ntasks = 4
+nsteps = 10
+
+b = barrier_t.new(ntasks)
+done = latch_t.new(ntasks)
+steps = vector_t.new()
+for i=1,ntasks do
+  steps[i] = 0
+end
+
+for t=1,ntasks do
+  async(function(t,b,done,steps,nsteps)
+    for s=1,nsteps do
+      steps:atomic_add(t,1)
+      b:Arrive():Get()
+    end
+    done:CountDown()
+  end,t,b,done,steps,nsteps)
+end
+
+done:Wait():Get()
+for t=1,ntasks do
+  print('task '..t..' took '..steps[t]..' steps')
+end
+
+--every locality waits here for the others
+barrier_t.global('example'):Arrive():Get()
+print('all localities arrived')
@@ -0,0 +1,36 @@
+--cancelling tasks, and waiting with timeouts
+
+--a task that would never finish stops when cancelled
+f = async(function()
+  local x = 0
+  while true do
+    x = x+1
+  end
+end)
+assert(not wait_all(f,0.05))
+assert(f:Cancel())
+assert(wait_all(f,10), 'cancelled task kept running')
+assert(f:Get() == nil)
+
+--only tasks started here can be cancelled
+assert(not make_ready_future(1):Cancel())
+
+--GetFor gives up after the timeout, or returns the values
+c = channel_t.new()
+r = c:Recv()
+x,err = r:GetFor(0.05)
+assert(x == nil and err == 'timeout')
+c:Send(7)
+assert(r:GetFor(1) == 7)
+
+g = async(function() return 1,2 end)
+a,b = g:GetFor(10)
+assert(a == 1 and b == 2)
+
+--a future with nothing to wait for
+x,err = future.new():GetFor(0.01)
+assert(x == nil and err == 'invalid future')
+
+assert(wait_all(make_ready_future(1),async(function() end),1))
+assert(not wait_all(c:Recv(),0.05))
+print('cancellation and timeouts passed')
@@ -0,0 +1,28 @@
+--a producer and a consumer connected by a bounded channel
+
+n = 100
+
+c = channel_t.new(4)
+
+--Send's future waits whenever 4 values are queued
+producer = async(function(c,n)
+  for i=1,n do
+    c:Send(i):Get()
+  end
+  c:Close()
+end,c,n)
+
+consumer = async(function(c)
+  local s = 0
+  while true do
+    local x = c:Recv():Get()
+    if x == nil then
+      break
+    end
+    s = s + x
+  end
+  return s
+end,c)
+
+producer:Get()
+print('sum='..consumer:Get()..' expected='..(n*(n+1)/2))
@@ -0,0 +1,67 @@
+--backpressure and closing of a bounded channel
+
+c = channel_t.new(2)
+
+--the first two fit, the third waits for room
+s1 = c:Send(1)
+s2 = c:Send(2)
+s3 = c:Send(3)
+assert(wait_all(s1,s2,1))
+x,err = s3:GetFor(0.05)
+assert(x == nil and err == 'timeout', 'Send did not wait for room')
+assert(c:Size() == 3)
+
+assert(c:Recv():Get() == 1)
+assert(wait_all(s3,1), 'Send still waiting after a Recv')
+
+--a sender still waiting when the channel closes gets its value queued
+s4 = c:Send(4)
+s5 = c:Send(5)
+c:Close()
+assert(wait_all(s4,s5,1), 'Close left a sender waiting')
+
+got = {}
+while true do
+  local x = c:Recv():Get()
+  if x == nil then
+    break
+  end
+  got[#got+1] = x
+end
+assert(#got == 4 and got[1] == 2 and got[2] == 3 and got[3] == 4 and got[4] == 5)
+
+--a receiver waiting on an empty channel is woken by Close
+d = channel_t.new()
+r = d:Recv()
+assert(not wait_all(r,0.05))
+d:Close()
+assert(wait_all(r,1) and r:Get() == nil)
+
+--many producers, one consumer
+ntasks = 4
+n = 100
+e = channel_t.new(3)
+l = latch_t.new(ntasks)
+for t=1,ntasks do
+  async(function(e,l,n)
+    for i=1,n do
+      e:Send(i):Get()
+    end
+    l:CountDown()
+  end,e,l,n)
+end
+--the last producer to finish closes the channel
+async(function(e,l)
+  l:Wait():Get()
+  e:Close()
+end,e,l)
+sum = 0
+while true do
+  local x = e:Recv():Get()
+  if x == nil then
+    break
+  end
+  sum = sum + x
+end
+assert(sum == ntasks*n*(n+1)/2, 'lost values: '..sum)
+print('channel passed')
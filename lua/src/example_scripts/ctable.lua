@@ -0,0 +1,44 @@
+--tasks writing to one concurrent table at the same time
+
+ntasks = 8
+n = 500
+
+t = table_t.concurrent(4)
+
+futs = {}
+for k=1,ntasks do
+  futs[k] = async(function(k,t,n)
+    for i=1,n do
+      t:Add('hits')
+      t:Add('sum',k)
+      t:Update('count',function(old)
+        return (old or 0)+1
+      end)
+    end
+    t:Set(k,k*k)
+  end,k,t,n)
+end
+wait_all(futs)
+
+assert(t:Get('hits') == ntasks*n, 'Add lost updates: '..t:Get('hits'))
+assert(t:Get('sum') == n*ntasks*(ntasks+1)/2, 'Add with delta: '..t:Get('sum'))
+assert(t:Get('count') == ntasks*n, 'Update lost updates: '..t:Get('count'))
+for k=1,ntasks do
+  assert(t:Get(k) == k*k)
+end
+assert(t:Size() == ntasks+3)
+
+--an Update returning nil removes the key
+t:Update('hits',function(old) return nil end)
+assert(t:Get('hits') == nil)
+assert(t:Size() == ntasks+2)
+
+--method names shadow data, Get and Set reach it
+t.x = 3
+assert(t.x == 3)
+t:Set('Get',5)
+assert(t:Get('Get') == 5)
+
+s = t:Snapshot()
+assert(s.count == ntasks*n and s.x == 3)
+print('concurrent table passed')
@@ -0,0 +1,17 @@
+--a vector spread over all localities
+
+n = 1000
+
+d = dvector.new(n,{policy='block_cyclic',block=16})
+
+--fill it, each partition where it lives
+d:ForEach(function(x,i) return i end):Get()
+
+--sum of 1..n
+s = d:Reduce(function(a,b) return a+b end,0):Get()
+print('sum='..s..' expected='..(n*(n+1)/2))
+
+d:Set(17,-1):Get()
+print('d[17]='..d:Get(17):Get())
+
+print('partitions here='..#d:LocalParts()..' of '..#d:Parts())
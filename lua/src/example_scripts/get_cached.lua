@@ -0,0 +1,35 @@
+--component:GetCached() sees the writes made through this locality
+
+c = component.new(find_here())
+lease = 60000
+
+c:Set('x',1):Get()
+assert(c:GetCached('x',lease):Get() == 1)
+assert(c:GetCached('x',lease):Get() == 1)
+
+--a write drops the cached value, however long the lease
+c:Set('x',2):Get()
+assert(c:GetCached('x',lease):Get() == 2, 'Set did not invalidate the cache')
+
+c:SetMany({x=3,y=4}):Get()
+assert(c:GetCached('x',lease):Get() == 3 and c:GetCached('y',lease):Get() == 4)
+
+--buffered writes show up once flushed
+c:SetBuffered('x',5)
+c:Flush():Get()
+assert(c:GetCached('x',lease):Get() == 5, 'Flush did not invalidate the cache')
+
+--a revalidation in flight during a write doesn't bring the old value back
+for i=6,50 do
+  local f = c:GetCached('x',0)
+  c:Set('x',i):Get()
+  f:Get()
+  assert(c:GetCached('x',lease):Get() == i, 'stale value after write '..i)
+end
+
+--with no lease every read asks the component
+c:Set('z',1):Get()
+assert(c:GetCached('z',0):Get() == 1)
+c:Set('z',2):Get()
+assert(c:GetCached('z',0):Get() == 2)
+print('component cache passed')
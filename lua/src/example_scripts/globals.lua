@@ -0,0 +1,57 @@
+--globals written on one locality reach the others
+
+here = find_here()
+remotes = {}
+for i,loc in ipairs(find_all_localities()) do
+  if ''..loc ~= ''..here then
+    remotes[#remotes+1] = loc
+  end
+end
+if #remotes == 0 then
+  print('globals: run on two or more localities to test, skipped')
+  return
+end
+
+function read_global(key)
+  return globals[key]
+end
+
+function write_global(key,value)
+  globals[key] = value
+  wait_all()
+end
+
+HPX_PLAIN_ACTION('read_global','write_global')
+
+--from here to the others, once wait_all says they arrived
+globals.greeting = 'hello'
+globals.answer = 42
+wait_all()
+for i,loc in ipairs(remotes) do
+  assert(async(loc,'read_global','greeting'):Get() == 'hello')
+  assert(async(loc,'read_global','answer'):Get() == 42)
+end
+
+--from another locality to here
+async(remotes[1],'write_global','back',7):Get()
+assert(globals.back == 7, 'remote write not seen here')
+
+--every locality writes one key at once, they all end up with the same value
+futs = {}
+for i,loc in ipairs(find_all_localities()) do
+  futs[i] = async(loc,'write_global','last',i)
+end
+wait_all(futs)
+v = globals.last
+assert(v ~= nil)
+for i,loc in ipairs(remotes) do
+  assert(async(loc,'read_global','last'):Get() == v, 'globals did not converge')
+end
+
+--a removed key is removed everywhere
+globals.answer = nil
+wait_all()
+for i,loc in ipairs(remotes) do
+  assert(async(loc,'read_global','answer'):Get() == nil)
+end
+print('globals passed')
@@ -0,0 +1,42 @@
+--readers in run_guarded_shared alongside writers in run_guarded
+
+n = 200
+
+function incr(x)
+  return (x or 0)+1
+end
+
+function peek(x)
+  return x
+end
+
+HPX_PLAIN_ACTION('incr','peek')
+
+g = guard.new()
+assert(run_guarded(g,'incr'):Get() == 1)
+
+writes = {}
+reads = {}
+for i=1,n do
+  writes[i] = run_guarded(g,'incr')
+  reads[i] = run_guarded_shared(g,'peek')
+end
+wait_all(writes)
+wait_all(reads)
+
+--each writer had the data to itself, so each saw another value
+seen = {}
+for i=1,n do
+  local x = writes[i]:Get()
+  assert(x >= 2 and x <= n+1 and not seen[x], 'writers overlapped at '..x)
+  seen[x] = true
+end
+
+--a reader running during a write would find the data cleared
+for i=1,n do
+  local x = reads[i]:Get()
+  assert(x ~= nil and x >= 1 and x <= n+1, 'reader saw '..tostring(x))
+end
+
+assert(run_guarded_shared(g,'peek'):Get() == n+1)
+print('guarded sections passed')
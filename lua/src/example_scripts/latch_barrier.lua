@@ -0,0 +1,54 @@
+--latches, and barriers over several rounds
+
+ntasks = 4
+nrounds = 20
+
+--a latch opens once counted down to zero, CountDown(k) counts k
+l = latch_t.new(3)
+assert(not l:IsReady())
+l:CountDown(2)
+assert(not wait_all(l:Wait(),0.05))
+l:CountDown()
+assert(wait_all(l:Wait(),1) and l:IsReady())
+
+--between the two Arrives of round r every task has counted r rounds
+b = barrier_t.new(ntasks)
+done = latch_t.new(ntasks)
+rounds = vector_t.new()
+errors = vector_t.new()
+for t=1,ntasks do
+  rounds[t] = 0
+end
+errors[1] = 0
+
+for t=1,ntasks do
+  async(function(t,b,done,rounds,errors,ntasks,nrounds)
+    for r=1,nrounds do
+      rounds:atomic_add(t,1)
+      b:Arrive():Get()
+      for k=1,ntasks do
+        if rounds[k] ~= r then
+          errors:atomic_add(1,1)
+        end
+      end
+      b:Arrive():Get()
+    end
+    done:CountDown()
+  end,t,b,done,rounds,errors,ntasks,nrounds)
+end
+
+assert(wait_all(done:Wait(),30), 'barrier rounds did not finish')
+assert(errors[1] == 0, errors[1]..' tasks ran ahead of the barrier')
+for t=1,ntasks do
+  assert(rounds[t] == nrounds)
+end
+
+--one task per locality, arriving at a global barrier every round
+hpx.broadcast(function(nrounds)
+  local b = barrier_t.global('latch_barrier')
+  for r=1,nrounds do
+    b:Arrive():Get()
+  end
+end,nrounds):Get()
+barrier_t.global('latch_barrier'):Free()
+print('latches and barriers passed')
@@ -0,0 +1,45 @@
+#include <hpx/hpx_main.hpp>
+#include <xlua.hpp>
+#include <chrono>
+#include <cstdlib>
+
+/**
+ * Measures what it costs to build a
+ * new Lua VM, i.e. what a task pays
+ * when the VM of its worker thread
+ * is busy, and what it costs to
+ * acquire an idle one through LuaEnv.
+ *
+ * usage: vm_bench [count]
+ */
+
+typedef std::chrono::high_resolution_clock clock_type;
+
+double usecs(clock_type::time_point ts,clock_type::time_point te,int n) {
+  return std::chrono::duration<double,std::micro>(te-ts).count()/n;
+}
+
+int main(int argc,char **argv) {
+  int n = 1000;
+  if(argc > 1)
+    n = std::atoi(argv[1]);
+
+  // Construction of a new VM
+  auto ts = clock_type::now();
+  for(int i=0;i<n;i++) {
+    hpx::Lua *lua = new hpx::Lua();
+    delete lua;
+  }
+  auto te = clock_type::now();
+  std::cout << "Lua::Lua() " << usecs(ts,te,n) << " usecs" << std::endl;
+
+  // Acquire and release the VM of this worker
+  ts = clock_type::now();
+  for(int i=0;i<n;i++) {
+    hpx::LuaEnv lenv;
+  }
+  te = clock_type::now();
+  std::cout << "LuaEnv " << usecs(ts,te,n) << " usecs" << std::endl;
+
+  return 0;
+}
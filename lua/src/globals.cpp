@@ -0,0 +1,280 @@
+#include "xlua.hpp"
+#include "xlua_prototypes.hpp"
+#include <hpx/lcos/broadcast.hpp>
+#include <hpx/runtime/get_config_entry.hpp>
+#include <hpx/lcos/local/spinlock.hpp>
+#include <algorithm>
+#include <mutex>
+
+namespace hpx {
+
+/**
+ * The table behind the Lua global "globals", shared by every VM of a
+ * locality and kept in step across localities.
+ *
+ * Keys are spread over the shards of a concurrent_table, so a reader
+ * only waits for a writer of the same shard, and a write costs the
+ * same however many keys there are. Writers also hold globals_mtx for
+ * the clock, the stamps and the border #globals, then send the write
+ * to the other localities. Each key carries a stamp, a Lamport clock
+ * and the writing locality, and the newest stamp wins, so all
+ * localities end up with the same value no matter in which order the
+ * writes arrive.
+ *
+ * Values are stored as given: a table_t or vector_t in globals is
+ * shared by pointer with every VM that reads it here.
+ */
+struct global_stamp {
+  boost::uint64_t clock = 0;
+  boost::uint32_t origin = 0;
+
+  bool newer_than(const global_stamp& st) const {
+    return clock > st.clock || (clock == st.clock && origin > st.origin);
+  }
+};
+
+concurrent_table globals_data(32);
+std::map<key_type,global_stamp> globals_stamps; // erased keys keep theirs
+int globals_size = 0;
+boost::uint64_t globals_clock = 0;
+hpx::lcos::local::mutex globals_mtx; // for all of the above but the data
+
+bool find_global(const key_type& key,Holder& h) {
+  concurrent_table::shard& sh = globals_data.get_shard(key);
+  std::lock_guard<hpx::lcos::local::mutex> lock(sh.mtx);
+  auto search = sh.t.find(key);
+  if(search == sh.t.end())
+    return false;
+  h = search->second;
+  return true;
+}
+
+int globals_border() {
+  std::lock_guard<hpx::lcos::local::mutex> lock(globals_mtx);
+  return globals_size;
+}
+
+table_ptr get_globals() {
+  table_ptr tp{new table_inner()};
+  for(auto i=globals_data.shards.begin();i != globals_data.shards.end();++i) {
+    std::lock_guard<hpx::lcos::local::mutex> lock((*i)->mtx);
+    tp->t.insert((*i)->t.begin(),(*i)->t.end());
+  }
+  // Writes that came in meanwhile may have moved the border
+  while(tp->t.find(double(tp->size+1)) != tp->t.end())
+    tp->size++;
+  return tp;
+}
+
+//--- Stamp a local write (stamp.clock == 0), or apply a remote one
+//--- if it is newer than what we have
+bool apply_global(const key_type& key,const Holder& h,global_stamp& st) {
+  std::lock_guard<hpx::lcos::local::mutex> lock(globals_mtx);
+  if(st.clock == 0) {
+    st.clock = ++globals_clock;
+    st.origin = hpx::get_locality_id();
+  } else if(st.clock > globals_clock) {
+    globals_clock = st.clock;
+  }
+  auto search = globals_stamps.find(key);
+  if(search != globals_stamps.end() && !st.newer_than(search->second))
+    return false;
+  globals_stamps[key] = st;
+  bool erase = h.var.which() == Holder::empty_t;
+  {
+    concurrent_table::shard& sh = globals_data.get_shard(key);
+    std::lock_guard<hpx::lcos::local::mutex> lock(sh.mtx);
+    if(erase)
+      sh.t.erase(key);
+    else
+      sh.t[key] = h;
+    ++sh.version;
+  }
+  if(key.which() == 0) {
+    double k = boost::get<double>(key);
+    Holder next;
+    if(erase && k >= 1 && k <= globals_size && k == int(k)) {
+      globals_size = int(k)-1;
+    } else if(!erase && k == 1 + globals_size) {
+      globals_size = int(k);
+      while(find_global(double(globals_size+1),next))
+        globals_size++;
+    }
+  }
+  return true;
+}
+
+int remote_global_set(key_type key,Holder h,boost::uint64_t clock,boost::uint32_t origin) {
+  global_stamp st;
+  st.clock = clock;
+  st.origin = origin;
+  apply_global(key,h,st);
+  return 1;
+}
+
+}
+
+HPX_PLAIN_ACTION(hpx::remote_global_set,remote_global_set_action);
+HPX_REGISTER_BROADCAST_ACTION_DECLARATION(remote_global_set_action);
+HPX_REGISTER_BROADCAST_ACTION(remote_global_set_action);
+
+namespace hpx {
+
+//--- Writes still on their way to other localities
+std::vector<future_type> pending_global_writes;
+hpx::lcos::local::spinlock pending_global_writes_mtx;
+
+ptr_type global_write_done(hpx::future<std::vector<int> > f) {
+  f.get();
+  return ptr_type(new std::vector<Holder>());
+}
+
+void set_global(const key_type& key,const Holder& h,bool publish) {
+  global_stamp st;
+  apply_global(key,h,st);
+  globals_consistency mode = get_globals_consistency();
+  if(!publish || mode == globals_local)
+    return;
+  std::vector<hpx::naming::id_type> remotes = hpx::find_remote_localities();
+  if(remotes.size() == 0)
+    return;
+  auto f = hpx::lcos::broadcast<remote_global_set_action>(
+    remotes,key,h,st.clock,st.origin);
+  if(mode == globals_sync) {
+    f.get();
+    return;
+  }
+  future_type fw = f.then(global_write_done);
+  std::lock_guard<hpx::lcos::local::spinlock> lock(pending_global_writes_mtx);
+  auto done = std::remove_if(pending_global_writes.begin(),pending_global_writes.end(),
+    [](const future_type& p) { return p.is_ready(); });
+  pending_global_writes.erase(done,pending_global_writes.end());
+  pending_global_writes.push_back(fw);
+}
+
+void flush_global_writes(std::vector<future_type>& futs) {
+  std::lock_guard<hpx::lcos::local::spinlock> lock(pending_global_writes_mtx);
+  futs.insert(futs.end(),pending_global_writes.begin(),pending_global_writes.end());
+  pending_global_writes.clear();
+}
+
+bool get_global_key(lua_State *L,int index,key_type& key) {
+  if(lua_type(L,index) == LUA_TNUMBER) {
+    key = lua_tonumber(L,index);
+  } else if(lua_isstring(L,index)) {
+    key = std::string(lua_tostring(L,index));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+//--- globals_t.snapshot() is a table_t copy of the current contents.
+//--- It lives in globals_t, not in globals, where every key is data.
+int globals_copy(lua_State *L) {
+  table_ptr copy = get_globals();
+  lua_pop(L,lua_gettop(L));
+  new_table(L);
+  *(table_ptr *)lua_touserdata(L,-1) = copy;
+  return 1;
+}
+
+int globals_index(lua_State *L) {
+  key_type key;
+  if(!get_global_key(L,2,key))
+    return 0;
+  lua_pop(L,lua_gettop(L));
+  Holder h;
+  if(!find_global(key,h))
+    return 0;
+  h.unpack(L);
+  return 1;
+}
+
+int globals_len(lua_State *L) {
+  lua_pushnumber(L,globals_border());
+  return 1;
+}
+
+//--- pairs(globals) and ipairs(globals) walk a copy of the contents
+//--- made when the loop starts
+void push_globals_table(lua_State *L) {
+  table_ptr copy = get_globals();
+  lua_pop(L,lua_gettop(L));
+  new_table(L);
+  *(table_ptr *)lua_touserdata(L,-1) = copy;
+}
+
+int globals_pairs(lua_State *L) {
+  push_globals_table(L);
+  table_pairs(L);
+  // The table is the loop state, it keeps the copy alive
+  lua_insert(L,1);
+  return 2;
+}
+
+int globals_ipairs(lua_State *L) {
+  push_globals_table(L);
+  return table_ipairs(L);
+}
+
+//--- Only assignments to globals are seen by others, changing a
+//--- table stored in it isn't
+int globals_new_index(lua_State *L) {
+  key_type key;
+  if(!get_global_key(L,2,key)) {
+    luai_writestringerror("Bad key for '%s' ","globals");
+    return 0;
+  }
+  Holder h;
+  if(!lua_isnil(L,3))
+    h.pack(L,3);
+  lua_pop(L,lua_gettop(L));
+  if(get_globals_consistency() != globals_local && !check_exportable(h))
+    return 0;
+  set_global(key,h,true);
+  return 0;
+}
+
+int new_globals(lua_State *L) {
+  lua_newuserdata(L,1);
+  luaL_setmetatable(L,globals_metatable_name);
+  return 1;
+}
+
+int open_globals(lua_State *L) {
+    static const struct luaL_Reg globals_funcs [] = {
+        {"snapshot", &globals_copy},
+        {NULL, NULL}
+    };
+
+    luaL_newlib(L,globals_funcs);
+
+    luaL_newmetatable(L,globals_metatable_name);
+
+    lua_pushstring(L,"__newindex");
+    lua_pushcfunction(L,globals_new_index);
+    lua_settable(L,-3);
+
+    lua_pushstring(L,"__index");
+    lua_pushcfunction(L,globals_index);
+    lua_settable(L,-3);
+
+    lua_pushstring(L,"__len");
+    lua_pushcfunction(L,globals_len);
+    lua_settable(L,-3);
+
+    lua_pushstring(L,"__pairs");
+    lua_pushcfunction(L,globals_pairs);
+    lua_settable(L,-3);
+
+    lua_pushstring(L,"__ipairs");
+    lua_pushcfunction(L,globals_ipairs);
+    lua_settable(L,-3);
+
+    lua_pop(L,1);
+
+    return 1;
+}
+
+}
@@ -509,6 +509,8 @@ int hpx_startup::user_main (int argc, char **argv) {
   if(connect_flag) {
     hpx::register_shutdown_function(stop_monitor);
   }
+  /* build the LVMs of all workers up front (xlua.prewarm) */
+  hpx::prewarm_lua_vms();
   auto ts = std::chrono::high_resolution_clock::now();
   int status, result;
   hpx::LuaEnv lenv;
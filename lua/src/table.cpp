@@ -1,5 +1,6 @@
 #include "xlua.hpp"
 #include "xlua_prototypes.hpp"
+#include <mutex>
 
 namespace hpx {
 //---table_iter structure--//
@@ -217,14 +218,223 @@ int table_new_index(lua_State *L) {
   return 1;
 }
 
+//---concurrent table structure--//
+
+//--- Userdata for a concurrent table, filled in by the caller
+int new_ctable(lua_State *L) {
+  size_t nbytes = sizeof(ctable_ptr);
+  char *table = (char *)lua_newuserdata(L,nbytes);
+  luaL_setmetatable(L,ctable_metatable_name);
+  new (table) ctable_ptr();
+  return 1;
+}
+
+//--- table_t.concurrent([shards])
+int ctable_new(lua_State *L) {
+  std::size_t n = 16;
+  if(lua_isnumber(L,1) && lua_tonumber(L,1) > 0)
+    n = lua_tointeger(L,1);
+  lua_pop(L,lua_gettop(L));
+  new_ctable(L);
+  ctable_ptr *tp = (ctable_ptr *)lua_touserdata(L,-1);
+  tp->reset(new concurrent_table(n));
+  return 1;
+}
+
+int hpx_ctable_clean(lua_State *L) {
+    if(cmp_meta(L,-1,ctable_metatable_name)) {
+      ctable_ptr *fnc = (ctable_ptr *)lua_touserdata(L,-1);
+      dtor(fnc);
+    }
+    return 1;
+}
+
+bool get_key(lua_State *L,int index,key_type& key) {
+  if(lua_type(L,index) == LUA_TNUMBER) {
+    key = lua_tonumber(L,index);
+  } else if(lua_isstring(L,index)) {
+    key = std::string(lua_tostring(L,index));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int ctable_name(lua_State *L) {
+  lua_pushstring(L,ctable_metatable_name);
+  return 1;
+}
+
+//--- Store h under key, nil erases it. The caller holds the lock.
+void ctable_store(concurrent_table::shard& sh,const key_type& key,const Holder& h) {
+  if(h.var.which() == Holder::empty_t)
+    sh.t.erase(key);
+  else
+    sh.t[key] = h;
+  ++sh.version;
+}
+
+//--- t:Update(key,f) replaces the value v under key with f(v), with
+//--- no other writer to key in between. f runs without the shard's
+//--- lock, so it may use the table. If the shard was written while f
+//--- ran, f is called again with the new value, so it should not have
+//--- side effects.
+int ctable_update(lua_State *L) {
+  key_type key;
+  if(!cmp_meta(L,1,ctable_metatable_name) || !get_key(L,2,key) || !lua_isfunction(L,3))
+    return 0;
+  ctable_ptr ct = *(ctable_ptr *)lua_touserdata(L,1);
+  concurrent_table::shard& sh = ct->get_shard(key);
+  while(true) {
+    Holder old;
+    std::size_t version;
+    {
+      std::lock_guard<hpx::lcos::local::mutex> lock(sh.mtx);
+      auto search = sh.t.find(key);
+      if(search != sh.t.end())
+        old = search->second;
+      version = sh.version;
+    }
+    lua_settop(L,3);
+    lua_pushvalue(L,3);
+    old.unpack(L);
+    if(lua_pcall(L,1,1,0) != 0) {
+      SHOW_ERROR(L);
+      return 0;
+    }
+    Holder h;
+    if(!lua_isnil(L,-1))
+      h.pack(L,-1);
+    std::lock_guard<hpx::lcos::local::mutex> lock(sh.mtx);
+    if(sh.version == version) {
+      ctable_store(sh,key,h);
+      return 1;
+    }
+  }
+}
+
+//--- t:Add(key,delta) adds to the number under key, missing is 0,
+//--- and returns the new value
+int ctable_add(lua_State *L) {
+  key_type key;
+  if(!cmp_meta(L,1,ctable_metatable_name) || !get_key(L,2,key))
+    return 0;
+  ctable_ptr ct = *(ctable_ptr *)lua_touserdata(L,1);
+  double delta = lua_isnumber(L,3) ? lua_tonumber(L,3) : 1;
+  lua_pop(L,lua_gettop(L));
+  concurrent_table::shard& sh = ct->get_shard(key);
+  double sum;
+  {
+    std::lock_guard<hpx::lcos::local::mutex> lock(sh.mtx);
+    Holder& h = sh.t[key];
+    sum = delta;
+    if(h.var.which() == Holder::num_t)
+      sum += boost::get<double>(h.var);
+    h.var = sum;
+    ++sh.version;
+  }
+  lua_pushnumber(L,sum);
+  return 1;
+}
+
+//--- t:Snapshot() copies the contents into a table_t, one shard at
+//--- a time
+int ctable_snapshot(lua_State *L) {
+  if(!cmp_meta(L,1,ctable_metatable_name))
+    return 0;
+  ctable_ptr ct = *(ctable_ptr *)lua_touserdata(L,1);
+  lua_pop(L,lua_gettop(L));
+  new_table(L);
+  table_ptr& tp = *(table_ptr *)lua_touserdata(L,-1);
+  for(auto i=ct->shards.begin();i != ct->shards.end();++i) {
+    std::lock_guard<hpx::lcos::local::mutex> lock((*i)->mtx);
+    tp->t.insert((*i)->t.begin(),(*i)->t.end());
+  }
+  while(tp->t.find(double(tp->size+1)) != tp->t.end())
+    tp->size++;
+  return 1;
+}
+
+int ctable_size(lua_State *L) {
+  if(!cmp_meta(L,1,ctable_metatable_name))
+    return 0;
+  ctable_ptr ct = *(ctable_ptr *)lua_touserdata(L,1);
+  std::size_t n = 0;
+  for(auto i=ct->shards.begin();i != ct->shards.end();++i) {
+    std::lock_guard<hpx::lcos::local::mutex> lock((*i)->mtx);
+    n += (*i)->t.size();
+  }
+  lua_pushnumber(L,n);
+  return 1;
+}
+
+//--- t:Get(key) reads any key, including the names of methods
+int ctable_get(lua_State *L) {
+  key_type key;
+  if(!cmp_meta(L,1,ctable_metatable_name) || !get_key(L,2,key))
+    return 0;
+  ctable_ptr ct = *(ctable_ptr *)lua_touserdata(L,1);
+  Holder h;
+  {
+    concurrent_table::shard& sh = ct->get_shard(key);
+    std::lock_guard<hpx::lcos::local::mutex> lock(sh.mtx);
+    auto search = sh.t.find(key);
+    if(search == sh.t.end())
+      return 0;
+    h = search->second;
+  }
+  lua_pop(L,lua_gettop(L));
+  h.unpack(L);
+  return 1;
+}
+
+//--- t:Set(key,x) is t[key]=x
+int ctable_set(lua_State *L) {
+  key_type key;
+  if(!cmp_meta(L,1,ctable_metatable_name) || !get_key(L,2,key))
+    return 0;
+  ctable_ptr ct = *(ctable_ptr *)lua_touserdata(L,1);
+  Holder h;
+  if(!lua_isnoneornil(L,3))
+    h.pack(L,3);
+  lua_pop(L,lua_gettop(L));
+  concurrent_table::shard& sh = ct->get_shard(key);
+  std::lock_guard<hpx::lcos::local::mutex> lock(sh.mtx);
+  ctable_store(sh,key,h);
+  return 0;
+}
+
+//--- t[key] finds the methods first, they are in the table of methods
+//--- kept as the upvalue. Other keys are data, t:Get(key) reads them all.
+int ctable_index(lua_State *L) {
+  lua_pushvalue(L,2);
+  lua_rawget(L,lua_upvalueindex(1));
+  if(!lua_isnil(L,-1))
+    return 1;
+  lua_pop(L,1);
+  return ctable_get(L);
+}
+
 int open_table(lua_State *L) {
     static const struct luaL_Reg table_meta_funcs [] = {
         {NULL,NULL},
     };
 
+    static const struct luaL_Reg ctable_meta_funcs [] = {
+        {"Name",&ctable_name},
+        {"Get",&ctable_get},
+        {"Set",&ctable_set},
+        {"Update",&ctable_update},
+        {"Add",&ctable_add},
+        {"Snapshot",&ctable_snapshot},
+        {"Size",&ctable_size},
+        {NULL,NULL},
+    };
+
     static const struct luaL_Reg table_funcs [] = {
         {"new", &new_table},
         {"linspace", &linspace},
+        {"concurrent", &ctable_new},
         {NULL, NULL}
     };
 
@@ -264,6 +474,23 @@ int open_table(lua_State *L) {
 
     lua_pop(L,1);
 
+    luaL_newmetatable(L,ctable_metatable_name);
+
+    lua_pushstring(L,"__gc");
+    lua_pushcfunction(L,hpx_ctable_clean);
+    lua_settable(L,-3);
+
+    lua_pushstring(L,"__newindex");
+    lua_pushcfunction(L,ctable_set);
+    lua_settable(L,-3);
+
+    lua_pushstring(L,"__index");
+    luaL_newlib(L, ctable_meta_funcs);
+    lua_pushcclosure(L,ctable_index,1);
+    lua_settable(L,-3);
+
+    lua_pop(L,1);
+
     return 1;
 }
 }
@@ -1,5 +1,7 @@
 #include "xlua.hpp"
 #include "xlua_prototypes.hpp"
+#include <algorithm>
+#include <cstring>
 
 namespace hpx {
 
@@ -86,6 +88,144 @@ int vector_pop(lua_State *L) {
   return 1;
 }
 
+//--- Atomic updates of single elements, for tasks sharing a vector.
+//--- The elements are plain doubles, so the CAS works on their storage
+//--- with the compiler's atomic builtins rather than through a cast to
+//--- std::atomic<double>.
+//---
+//--- Contract: these never grow the vector, size it before sharing it.
+//--- Growing it (v[i]=x past the end, or vector_pop) while another
+//--- task runs one of these moves the storage under it, and is not
+//--- allowed.
+inline double atomic_load_elem(double *p) {
+  double d;
+  __atomic_load(p,&d,__ATOMIC_SEQ_CST);
+  return d;
+}
+
+//--- On failure expected is set to the value found
+inline bool atomic_cas_elem(double *p,double& expected,double desired,bool weak) {
+  return __atomic_compare_exchange(p,&expected,&desired,weak,
+    __ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+}
+
+//--- Apply f to element i until no other task got in between
+template<typename F>
+double atomic_update(vector_ptr& v,int i,F f) {
+  double *p = &(*v)[i];
+  double old = atomic_load_elem(p);
+  double val = f(old);
+  while(!atomic_cas_elem(p,old,val,true))
+    val = f(old);
+  return val;
+}
+
+bool check_index(lua_State *L,vector_ptr& v,int i,const char *name) {
+  if(i < 1 || i >= v->size()) {
+    luai_writestringerror("Index out of range in '%s' ",name);
+    return false;
+  }
+  return true;
+}
+
+//--- v:atomic_add(i,x) returns the new value
+int vector_atomic_add(lua_State *L) {
+  vector_ptr& v = *(vector_ptr *)lua_touserdata(L,1);
+  int i = lua_tointeger(L,2);
+  double x = lua_tonumber(L,3);
+  if(!check_index(L,v,i,"atomic_add"))
+    return 0;
+  lua_pushnumber(L,atomic_update(v,i,[x](double old) { return old+x; }));
+  return 1;
+}
+
+int vector_atomic_min(lua_State *L) {
+  vector_ptr& v = *(vector_ptr *)lua_touserdata(L,1);
+  int i = lua_tointeger(L,2);
+  double x = lua_tonumber(L,3);
+  if(!check_index(L,v,i,"atomic_min"))
+    return 0;
+  lua_pushnumber(L,atomic_update(v,i,[x](double old) { return std::min(old,x); }));
+  return 1;
+}
+
+int vector_atomic_max(lua_State *L) {
+  vector_ptr& v = *(vector_ptr *)lua_touserdata(L,1);
+  int i = lua_tointeger(L,2);
+  double x = lua_tonumber(L,3);
+  if(!check_index(L,v,i,"atomic_max"))
+    return 0;
+  lua_pushnumber(L,atomic_update(v,i,[x](double old) { return std::max(old,x); }));
+  return 1;
+}
+
+//--- v:compare_exchange(i,expected,desired) returns whether it was
+//--- stored, and the value found
+int vector_compare_exchange(lua_State *L) {
+  vector_ptr& v = *(vector_ptr *)lua_touserdata(L,1);
+  int i = lua_tointeger(L,2);
+  double expected = lua_tonumber(L,3);
+  double desired = lua_tonumber(L,4);
+  if(!check_index(L,v,i,"compare_exchange"))
+    return 0;
+  bool ok = atomic_cas_elem(&(*v)[i],expected,desired,false);
+  lua_pushboolean(L,ok);
+  lua_pushnumber(L,expected);
+  return 2;
+}
+
+//--- Element n of a vector_t or Lua table argument
+double get_nth(lua_State *L,int index,int n) {
+  if(cmp_meta(L,index,vector_metatable_name)) {
+    vector_ptr& v = *(vector_ptr *)lua_touserdata(L,index);
+    return n < v->size() ? (*v)[n] : 0;
+  }
+  lua_rawgeti(L,index,n);
+  double d = lua_tonumber(L,-1);
+  lua_pop(L,1);
+  return d;
+}
+
+int get_len(lua_State *L,int index) {
+  if(cmp_meta(L,index,vector_metatable_name)) {
+    vector_ptr& v = *(vector_ptr *)lua_touserdata(L,index);
+    return v->size() > 0 ? v->size()-1 : 0;
+  }
+  return luaL_len(L,index);
+}
+
+//--- v:scatter_add(indices,values) adds values[k] to v[indices[k]],
+//--- values can be a single number, e.g. 1 for a histogram
+int vector_scatter_add(lua_State *L) {
+  vector_ptr& v = *(vector_ptr *)lua_touserdata(L,1);
+  if(!lua_istable(L,2) && !cmp_meta(L,2,vector_metatable_name)) {
+    luai_writestringerror("Argument to '%s' is not a table or vector ","scatter_add");
+    return 0;
+  }
+  bool scalar = lua_isnumber(L,3);
+  if(!scalar && !lua_istable(L,3) && !cmp_meta(L,3,vector_metatable_name)) {
+    luai_writestringerror("Argument to '%s' is not a number, table or vector ","scatter_add");
+    return 0;
+  }
+  double x = scalar ? lua_tonumber(L,3) : 0;
+  // Check every index first, so a bad one adds nothing
+  int n = get_len(L,2);
+  std::vector<int> indices(n);
+  for(int k=1;k<=n;k++) {
+    indices[k-1] = get_nth(L,2,k);
+    if(!check_index(L,v,indices[k-1],"scatter_add"))
+      return 0;
+  }
+  for(int k=1;k<=n;k++) {
+    double d = scalar ? x : get_nth(L,3,k);
+    atomic_update(v,indices[k-1],[d](double old) { return old+d; });
+  }
+  lua_pop(L,lua_gettop(L));
+  return 0;
+}
+
+//--- v[i]=x grows the vector as needed. That must not happen while
+//--- other tasks use the atomic methods on it, see above.
 int vector_new_index(lua_State *L) {
   vector_ptr *fnc_p = (vector_ptr *)lua_touserdata(L,1);
   vector_ptr& fnc = *fnc_p;
@@ -97,7 +237,22 @@ int vector_new_index(lua_State *L) {
     return 0;
   } else { // get
     if(!lua_isnumber(L,2)) {
+      static const struct luaL_Reg vector_meta_funcs [] = {
+          {"atomic_add",&vector_atomic_add},
+          {"atomic_min",&vector_atomic_min},
+          {"atomic_max",&vector_atomic_max},
+          {"compare_exchange",&vector_compare_exchange},
+          {"scatter_add",&vector_scatter_add},
+          {NULL,NULL},
+      };
+      const char *name = lua_tostring(L,2);
       lua_pop(L,lua_gettop(L));
+      for(const luaL_Reg *m = vector_meta_funcs;name != nullptr && m->name != NULL;++m) {
+        if(strcmp(name,m->name) == 0) {
+          lua_pushcfunction(L,m->func);
+          return 1;
+        }
+      }
       lua_pushcfunction(L,vector_name);
       return 1;
     }
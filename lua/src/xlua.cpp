@@ -1,20 +1,24 @@
 #include "xlua.hpp"
 #include "xlua_prototypes.hpp"
 #include <hpx/lcos/broadcast.hpp>
+#include <hpx/runtime/get_config_entry.hpp>
+#include <hpx/lcos/local/latch.hpp>
+#include <hpx/lcos/local/spinlock.hpp>
+#if defined(HPX_HAVE_PARCEL_COALESCING)
+#include <hpx/include/parcel_coalescing.hpp>
+#endif
+#include <algorithm>
+#include <boost/chrono.hpp>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <set>
 
 const int max_output_args = 10;
 
-#define CHECK_STRING(INDEX,NAME) \
-  if(!lua_isstring(L,INDEX)) { \
-    luai_writestringerror("Argument to '%s' is not a string ",NAME);\
-    return 0; \
-  }
-
-#ifndef luai_writestringerror
-#define luai_writestringerror(s,p) \
-        (fprintf(stderr, (s), (p)), fflush(stderr))
-#endif
-
 namespace hpx {
 std::string env = "_ENV";
 
@@ -65,126 +69,201 @@ const char *future_metatable_name = "hpx_future";
 const char *guard_metatable_name = "hpx_guard";
 const char *locality_metatable_name = "hpx_locality";
 const char *lua_client_metatable_name = "lua_client";
+const char *dvector_metatable_name = "dvector_t";
+const char *globals_metatable_name = "globals_t";
+const char *ctable_metatable_name = "ctable_t";
+const char *channel_metatable_name = "channel_t";
+const char *latch_metatable_name = "latch_t";
+const char *barrier_metatable_name = "barrier_t";
 
 const char *hpx_metatable_name = "hpx";
+const char *cancel_metatable_name = "hpx_cancel";
 
-table_ptr globals{new table_inner};
 
 const char *lua_read(lua_State *L,void *data,size_t *size);
 int lua_write(lua_State *L,const char *str,unsigned long len,std::string *buf);
 bool cmp_meta(lua_State *L,int index,const char *meta_name);
 
-  Lua::Lua() : busy(true), L(luaL_newstate()) {
+//--- A malformed entry gets the default, not an exception
+int config_int(const char *key,int dflt) {
+  std::string s = hpx::get_config_entry(key,std::to_string(dflt));
+  const char *str = s.c_str();
+  char *end = nullptr;
+  errno = 0;
+  long v = std::strtol(str,&end,10);
+  if(end == str || *end != '\0' || errno != 0 || v < INT_MIN || v > INT_MAX)
+    return dflt;
+  return int(v);
+}
+
+//--- Collector settings for every VM. Read from the HPX configuration, e.g.
+//--- --hpx:ini=xlua.gc.pause=150 --hpx:ini=xlua.gc.idle_step=8
+struct gc_policy {
+  int pause;
+  int stepmul;
+  int idle_step;
+  bool generational;
+  gc_policy(bool from_config) : pause(200), stepmul(200), idle_step(0), generational(false) {
+    if(from_config) {
+      pause = config_int("xlua.gc.pause",200);
+      stepmul = config_int("xlua.gc.stepmul",200);
+      idle_step = config_int("xlua.gc.idle_step",0);
+      generational = config_int("xlua.gc.generational",0) != 0;
+    }
+  }
+};
+
+//--- VMs can be built before hpx::init (see pre_hpx_init.lua), so only
+//--- cache the configured values once the runtime exists.
+gc_policy const& get_gc_policy() {
+  static gc_policy defaults(false);
+  if(hpx::get_runtime_ptr() == nullptr)
+    return defaults;
+  static gc_policy policy(true);
+  return policy;
+}
+
+void apply_gc_policy(lua_State *L) {
+  gc_policy const& gp = get_gc_policy();
+#ifdef LUA_GCGEN
+  if(gp.generational)
+    lua_gc(L,LUA_GCGEN,0);
+  else
+    lua_gc(L,LUA_GCINC,0);
+#endif
+  lua_gc(L,LUA_GCSETPAUSE,gp.pause);
+  lua_gc(L,LUA_GCSETSTEPMUL,gp.stepmul);
+}
+
+std::atomic<boost::int64_t> gc_time{0};
+std::atomic<boost::int64_t> gc_steps{0};
+
+boost::int64_t get_gc_time(bool reset) {
+  return reset ? gc_time.exchange(0) : gc_time.load();
+}
+
+boost::int64_t get_gc_steps(bool reset) {
+  return reset ? gc_steps.exchange(0) : gc_steps.load();
+}
+
+//--- Global functions installed in every VM
+const struct luaL_Reg xlua_globals[] = {
+  {"stop",xlua_stop},
+  {"start",xlua_start},
+  {"get_value",xlua_get_value},
+  {"get_counter",xlua_get_counter},
+  {"discover_counter_types",discover},
+  {"make_ready_future",make_ready_future},
+  {"dataflow",dataflow},
+  {"unwrapped",xlua_unwrapped},
+  {"call",call},
+  {"async",async},
+  {"async_at",async_at},
+  {"vector_pop",vector_pop},
+  {"wait_all",luax_wait_all},
+  {"when_all",luax_when_all},
+  {"when_any",luax_when_any},
+  {"unwrap",unwrap},
+  {"isfuture",isfuture},
+  {"isvector",isvector},
+  {"islocality",islocality},
+  {"istable",istable},
+  {"HPX_PLAIN_ACTION",hpx_reg},
+  {"hpx_run",hpx_run},
+  {"run_guarded",luax_run_guarded},
+  {"run_guarded_shared",luax_run_guarded_shared},
+  {"find_here",find_here},
+  {"find_all_localities",all_localities},
+  {"find_remote_localities",remote_localities},
+  {"find_root_locality",root_locality},
+//  {"apex_register_policy",apex_register_policy},
+  {NULL,NULL}
+};
+
+//--- Modules opened in every VM
+const struct luaL_Reg xlua_modules[] = {
+  {"hpx",open_hpx},
+  {"table_t",open_table},
+  {"vector_t",open_vector},
+  {"table_iter_t",open_table_iter},
+  {"future",open_future},
+  {"guard",open_guard},
+  {"locality",open_locality},
+  {"component",open_component},
+  {"dvector",open_dvector},
+  {"globals_t",open_globals},
+  {"channel_t",open_channel},
+  {"latch_t",open_latch},
+  {"barrier_t",open_barrier},
+  {NULL,NULL}
+};
+
+const char *prelude_src =
+  " function for_each_s(i0,ihi,f)"
+  "  local i"
+  "  for i=i0,ihi do"
+  "    f(i)"
+  "  end"
+  " end"
+  ""
+  " function for_each(lo,hi,f,gr)"
+  "  local i0,ihi,fs"
+  "  if gr == nil then"
+  "    gr = math.floor((hi-lo+1)/8)"
+  "  end"
+  "  if gr <= 0 then"
+  "    gr = 1"
+  "  end"
+  "  fs = {}"
+  "  for i0=lo,hi,gr do"
+  "    ihi = math.min(hi,i0+gr-1)"
+  "    fs[#fs+1]=async(for_each_s,i0,ihi,f)"
+  "  end"
+  "  wait_all(fs)"
+  " end";
+
+//--- Compile Lua source to bytecode without running it
+std::string compile_lua(const char *src,const char *name) {
+  std::string bytecode;
+  lua_State *L = luaL_newstate();
+  if(luaL_loadbuffer(L,src,strlen(src),name) != LUA_OK) {
+    SHOW_ERROR(L);
+  } else {
+    lua_dump(L,(lua_Writer)lua_write,&bytecode,true);
+  }
+  lua_close(L);
+  return bytecode;
+}
+
+//--- The prelude is parsed once per process, not once per VM
+const std::string& prelude_bytecode() {
+  static const std::string bytecode = compile_lua(prelude_src,"=prelude");
+  return bytecode;
+}
+
+  Lua::Lua() : busy(true), L(luaL_newstate()), registry_generation(0) {
+    // Nothing built here is garbage, don't collect while building it
+    lua_gc(L,LUA_GCSTOP,0);
     luaL_openlibs(L);
-    lua_pushcfunction(L,xlua_stop);
-    lua_setglobal(L,"stop");
-    lua_pushcfunction(L,xlua_start);
-    lua_setglobal(L,"start");
-    lua_pushcfunction(L,xlua_get_value);
-    lua_setglobal(L,"get_value");
-    lua_pushcfunction(L,xlua_get_counter);
-    lua_setglobal(L,"get_counter");
-    lua_pushcfunction(L,discover);
-    lua_setglobal(L,"discover_counter_types");
-    lua_pushcfunction(L,make_ready_future);
-    lua_setglobal(L,"make_ready_future");
-    lua_pushcfunction(L,dataflow);
-    lua_setglobal(L,"dataflow");
-    lua_pushcfunction(L,xlua_unwrapped);
-    lua_setglobal(L,"unwrapped");
-    lua_pushcfunction(L,call);
-    lua_setglobal(L,"call");
-    lua_pushcfunction(L,async);
-    lua_setglobal(L,"async");
-    lua_pushcfunction(L,vector_pop);
-    lua_setglobal(L,"vector_pop");
-    lua_pushcfunction(L,luax_wait_all);
-    lua_setglobal(L,"wait_all");
-    lua_pushcfunction(L,luax_when_all);
-    lua_setglobal(L,"when_all");
-    lua_pushcfunction(L,luax_when_any);
-    lua_setglobal(L,"when_any");
-    lua_pushcfunction(L,unwrap);
-    lua_setglobal(L,"unwrap");
-    lua_pushcfunction(L,isfuture);
-    lua_setglobal(L,"isfuture");
-    lua_pushcfunction(L,isvector);
-    lua_setglobal(L,"isvector");
-    lua_pushcfunction(L,islocality);
-    lua_setglobal(L,"islocality");
-    lua_pushcfunction(L,istable);
-    lua_setglobal(L,"istable");
-    lua_pushcfunction(L,hpx_reg);
-    lua_setglobal(L,"HPX_PLAIN_ACTION");
-    lua_pushcfunction(L,hpx_run);
-    lua_setglobal(L,"hpx_run");
-    lua_pushcfunction(L,luax_run_guarded);
-    lua_setglobal(L,"run_guarded");
-    lua_pushcfunction(L,find_here);
-    lua_setglobal(L,"find_here");
-    lua_pushcfunction(L,all_localities);
-    lua_setglobal(L,"find_all_localities");
-    lua_pushcfunction(L,remote_localities);
-    lua_setglobal(L,"find_remote_localities");
-    lua_pushcfunction(L,root_locality);
-    lua_setglobal(L,"find_root_locality");
-//    lua_pushcfunction(L,apex_register_policy);
-//    lua_setglobal(L,"apex_register_policy");
-
-    //open_hpx(L);
-    luaL_requiref(L, "hpx",&open_hpx, 1);
-    open_table(L);
-    luaL_requiref(L, "table_t", &open_table, 1);
-    luaL_requiref(L, "vector_t", &open_vector, 1);
-    open_table_iter(L);
-    luaL_requiref(L, "table_iter_t", &open_table_iter, 1);
-    open_future(L);
-    luaL_requiref(L, "future", &open_future, 1);
-    open_guard(L);
-    luaL_requiref(L, "guard",&open_guard, 1);
-    open_locality(L);
-    luaL_requiref(L, "locality",&open_locality, 1);
-    luaL_requiref(L, "component",&open_component, 1);
-    lua_pop(L,lua_gettop(L));
+    lua_pushglobaltable(L);
+    luaL_setfuncs(L,xlua_globals,0);
+    lua_pop(L,1);
+
+    for(const luaL_Reg *m = xlua_modules;m->name != NULL;++m) {
+      luaL_requiref(L,m->name,m->func,1);
+      lua_pop(L,1);
+    }
 
-    new_table(L);
-    table_ptr *tp = (table_ptr *)lua_touserdata(L,-1);
-    *tp = globals;
+    new_globals(L);
     lua_setglobal(L,"globals");
-    luaL_dostring(L,
-      " function for_each_s(i0,ihi,f)"
-      "  local i"
-      "  for i=i0,ihi do"
-      "    f(i)"
-      "  end"
-      " end"
-      ""
-      " function for_each(lo,hi,f,gr)"
-      "  local i0,ihi,fs"
-      "  if gr == nil then"
-      "    gr = math.floor((hi-lo+1)/8)"
-      "  end"
-      "  if gr <= 0 then"
-      "    gr = 1"
-      "  end"
-      "  fs = {}"
-      "  for i0=lo,hi,gr do"
-      "    ihi = math.min(hi,i0+gr-1)"
-      "    fs[#fs+1]=async(for_each_s,i0,ihi,f)"
-      "  end"
-      "  wait_all(fs)"
-      " end"
-  );
-
-    for(auto i=function_registry.begin();i != function_registry.end();++i) {
-      // Insert into table
-      if(lua_load(L,(lua_Reader)lua_read,(void *)&i->second,i->first.c_str(),"b") != 0) {
-        std::cout << "function " << i->first << " size=" << i->second.size() << std::endl;
-        SHOW_ERROR(L);
-      } else {
-        lua_setglobal(L,i->first.c_str());
-      }
+
+    const std::string& prelude = prelude_bytecode();
+    if(lua_load(L,(lua_Reader)lua_read,(void *)&prelude,"=prelude","b") != LUA_OK
+        || lua_pcall(L,0,0,0) != LUA_OK) {
+      SHOW_ERROR(L);
     }
+
+    sync_registry();
     /*
     luaL_dostring(L,
 "function __hpx_nextvalue(obj)"
@@ -199,6 +278,8 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
 "  return t"
 "end");
 */
+    lua_gc(L,LUA_GCRESTART,0);
+    apply_gc_policy(L);
     busy = false;
   }
   void Holder::unpack(lua_State *L) {
@@ -282,6 +363,25 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
         }
         lua_pop(L,lua_gettop(L)-findex);
       }
+    } else if(var.which() == ctable_t) {
+      new_ctable(L);
+      ctable_ptr *tp = (ctable_ptr *)lua_touserdata(L,-1);
+      *tp = boost::get<ctable_ptr>(var);
+    } else if(var.which() == chan_t) {
+      new_channel(L);
+      channel_ptr *cp = (channel_ptr *)lua_touserdata(L,-1);
+      *cp = boost::get<channel_ptr>(var);
+    } else if(var.which() == sync_t) {
+      const sync_ptr& sp = boost::get<sync_ptr>(var);
+      if(sp->reusable)
+        new_barrier(L);
+      else
+        new_latch(L);
+      *(sync_ptr *)lua_touserdata(L,-1) = sp;
+    } else if(var.which() == fref_t) {
+      new_future(L);
+      future_type *fc = (future_type *)lua_touserdata(L,-1);
+      *fc = resolve_future_ref(boost::get<future_ref>(var));
     } else if(var.which() == empty_t) {
       lua_pushnil(L);
     } else {
@@ -313,6 +413,19 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
         var = *(hpx::naming::id_type *)lua_touserdata(L,index);
       } else if(s == lua_client_metatable_name) {
         var = *(lua_aux_client *)lua_touserdata(L,index);
+      } else if(s == ctable_metatable_name) {
+        var = *(ctable_ptr *)lua_touserdata(L,index);
+      } else if(s == channel_metatable_name) {
+        var = *(channel_ptr *)lua_touserdata(L,index);
+      } else if(s == latch_metatable_name || s == barrier_metatable_name) {
+        var = *(sync_ptr *)lua_touserdata(L,index);
+      } else if(s == globals_metatable_name) {
+        // Pass what globals holds now, the task may change its copy
+        var = get_globals();
+      } else if(s == dvector_metatable_name) {
+        // Its parts are components, pass them instead
+        luai_writestringerror("A '%s' can't be passed to a task, pass d:Parts() instead ",
+          dvector_metatable_name);
       } else {
         std::cerr << "Can't pack key value!" << lua_type(L,-1) << " s=" << s << std::endl;
         abort();
@@ -429,6 +542,11 @@ int get_mtable(lua_State *L) {
     return false;
   if(!lua_isuserdata(L,-1))
     return false;
+  // Every key of globals is data, it has no Name() to ask
+  if(luaL_testudata(L,-1,globals_metatable_name) != nullptr) {
+    lua_pushstring(L,globals_metatable_name);
+    return lua_gettop(L);
+  }
   int ss1 = lua_gettop(L);
   lua_getfield(L,-1,"Name");
   int ss2 = lua_gettop(L);
@@ -449,6 +567,8 @@ bool cmp_meta(lua_State *L,int index,const char *name) {
     return false;
   if(!lua_isuserdata(L,index))
     return false;
+  if(luaL_testudata(L,index,globals_metatable_name) != nullptr)
+    return std::string(globals_metatable_name) == name;
   int ss1 = lua_gettop(L);
   lua_getfield(L,index,"Name");
   int ss2 = lua_gettop(L);
@@ -514,6 +634,18 @@ std::ostream& operator<<(std::ostream& out,const Holder& holder) {
     case Holder::fut_t:
       out << "Fut()";
       break;
+    case Holder::fref_t:
+      out << "FutRef()";
+      break;
+    case Holder::ctable_t:
+      out << "ConcurrentTable()";
+      break;
+    case Holder::chan_t:
+      out << "Channel()";
+      break;
+    case Holder::sync_t:
+      out << (boost::get<sync_ptr>(holder.var)->reusable ? "Barrier()" : "Latch()");
+      break;
     case Holder::ptr_t:
       {
         ptr_type p = boost::get<ptr_type>(holder.var);
@@ -625,7 +757,73 @@ std::ostream& show_stack(std::ostream& o,lua_State *L,const char *fname,int line
 }
 
 //--- Synchronization for the function registry process
-std::map<std::string,std::string> function_registry;
+registry_ptr function_registry{new function_registry_type()};
+std::atomic<std::size_t> function_registry_generation{0};
+hpx::lcos::local::spinlock function_registry_mtx;
+
+registry_ptr get_function_registry() {
+  return std::atomic_load(&function_registry);
+}
+
+bool find_function(const std::string& fname,std::string& bytecode) {
+  registry_ptr reg = get_function_registry();
+  auto search = reg->functions.find(fname);
+  if(search == reg->functions.end())
+    return false;
+  bytecode = search->second.bytecode;
+  return true;
+}
+
+std::size_t publish_functions(const registry_map& changes,
+    std::size_t version,boost::uint32_t origin) {
+  std::lock_guard<hpx::lcos::local::spinlock> lock(function_registry_mtx);
+  std::shared_ptr<function_registry_type> reg{
+    new function_registry_type(*get_function_registry())};
+  if(version == 0) {
+    version = ++reg->clock;
+    origin = hpx::get_locality_id();
+  } else {
+    reg->clock = std::max(reg->clock,version);
+  }
+  reg->generation++;
+  for(auto i=changes.begin();i != changes.end();++i) {
+    auto search = reg->functions.find(i->first);
+    if(search != reg->functions.end()) {
+      registry_entry& e = search->second;
+      // Deltas can arrive out of order, keep the newest
+      if(std::make_pair(e.version,e.origin) > std::make_pair(version,origin))
+        continue;
+    }
+    registry_entry& e = reg->functions[i->first];
+    e.bytecode = i->second;
+    e.generation = reg->generation;
+    e.version = version;
+    e.origin = origin;
+  }
+  std::atomic_store(&function_registry,registry_ptr(reg));
+  function_registry_generation = reg->generation;
+  return version;
+}
+
+void Lua::sync_registry() {
+  // Fast path, nothing was registered since the last sync
+  if(registry_generation == function_registry_generation)
+    return;
+  registry_ptr reg = get_function_registry();
+  for(auto i=reg->functions.begin();i != reg->functions.end();++i) {
+    if(i->second.generation <= registry_generation)
+      continue;
+    // Insert into table
+    std::string& bytecode = const_cast<std::string&>(i->second.bytecode);
+    if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,i->first.c_str(),"b") != 0) {
+      std::cout << "function " << i->first << " size=" << bytecode.size() << std::endl;
+      SHOW_ERROR(L);
+    } else {
+      lua_setglobal(L,i->first.c_str());
+    }
+  }
+  registry_generation = reg->generation;
+}
 
 #include <hpx/util/thread_specific_ptr.hpp>
 struct lua_interpreter_tag {};
@@ -640,37 +838,105 @@ Lua *get_lua_ptr() {
     LuaHolder *h = lua_ptr.get();
     if(h == nullptr)
       lua_ptr.reset(h = new LuaHolder());
-    Lua *lua = h->held;
-    if(lua == nullptr) {
+    Lua *lua;
+    if(h->held.empty()) {
         lua = new Lua();
     } else {
-      h->held = nullptr;
-    }
-    lua_State *L = lua->get_state();
-    for(auto i=function_registry.begin();i != function_registry.end();++i) {
-      // Insert into table
-      if(lua_load(L,(lua_Reader)lua_read,(void *)&i->second,i->first.c_str(),"b") != 0) {
-        std::cout << "function " << i->first << " size=" << i->second.size() << std::endl;
-        SHOW_ERROR(L);
-      } else {
-        lua_setglobal(L,i->first.c_str());
-      }
+      lua = h->held.back();
+      h->held.pop_back();
     }
+    lua->sync_registry();
     return lua;
 }
 
+//--- Runs at low priority, i.e. only when the worker has nothing
+//--- else to do. Advances the collector of the VMs parked on the
+//--- worker that scheduled it, so the cost isn't paid in the middle
+//--- of a task. Low priority work can be stolen, and another worker
+//--- mustn't touch h's VMs, so then it only lets h schedule again.
+void idle_gc_step(LuaHolder *h) {
+  h->gc_pending = false;
+  if(lua_ptr.get() != h)
+    return;
+  for(auto i=h->held.begin();i != h->held.end();++i) {
+    Lua *lua = *i;
+    if(lua->busy)
+      continue;
+    auto ts = std::chrono::high_resolution_clock::now();
+    lua_gc(lua->get_state(),LUA_GCSTEP,get_gc_policy().idle_step);
+    auto te = std::chrono::high_resolution_clock::now();
+    gc_time += std::chrono::duration_cast<std::chrono::nanoseconds>(te-ts).count();
+    gc_steps++;
+  }
+}
+
+//--- How many idle VMs a worker keeps. At least one, and enough
+//--- to hold the prewarmed ones.
+std::size_t get_pool_size() {
+  if(hpx::get_runtime_ptr() == nullptr)
+    return 1;
+  static std::size_t pool_size = std::max(1,
+    std::max(config_int("xlua.pool_size",1),config_int("xlua.prewarm",0)));
+  return pool_size;
+}
+
 void set_lua_ptr(Lua *lua) {
   LuaHolder *h = lua_ptr.get();
   if(h == nullptr)
     lua_ptr.reset(h = new LuaHolder());
-  Lua *l = h->held;
-  if(l == nullptr) {
-    h->held = lua;
+  if(h->held.size() < get_pool_size()) {
+    h->held.push_back(lua);
+    if(!h->gc_pending && get_gc_policy().idle_step > 0 && hpx::threads::get_self_ptr() != nullptr) {
+      h->gc_pending = true;
+      hpx::applier::register_thread_nullary(
+        boost::bind(idle_gc_step,h),"xlua_idle_gc",hpx::threads::pending,true,
+        hpx::threads::thread_priority_low,hpx::get_worker_thread_num());
+    }
   } else {
     delete lua;
   }
 }
 
+void prewarm_worker(std::size_t n) {
+  LuaHolder *h = lua_ptr.get();
+  if(h == nullptr)
+    lua_ptr.reset(h = new LuaHolder());
+  while(h->held.size() < n)
+    h->held.push_back(new Lua());
+}
+
+//--- Hinted threads can still be stolen. One that lands on the wrong
+//--- worker goes back to its own, a few times at most, so a busy
+//--- worker can't hold up startup forever.
+void prewarm_on(std::size_t worker,int n,int tries,hpx::lcos::local::latch *done) {
+  if(hpx::get_worker_thread_num() != worker && tries > 0) {
+    hpx::applier::register_thread_nullary(
+      boost::bind(prewarm_on,worker,n,tries-1,done),
+      "xlua_prewarm",hpx::threads::pending,true,
+      hpx::threads::thread_priority_normal,worker);
+    return;
+  }
+  prewarm_worker(n);
+  done->count_down(1);
+}
+
+void prewarm_lua_vms(int n) {
+  if(n < 0)
+    n = config_int("xlua.prewarm",0);
+  if(n <= 0)
+    return;
+  // One thread for each worker, all building their VMs at once
+  std::size_t nt = hpx::get_os_thread_count();
+  hpx::lcos::local::latch done(nt+1);
+  for(std::size_t i=0;i<nt;i++) {
+    hpx::applier::register_thread_nullary(
+      boost::bind(prewarm_on,i,n,16,&done),
+      "xlua_prewarm",hpx::threads::pending,true,
+      hpx::threads::thread_priority_normal,i);
+  }
+  done.count_down_and_wait();
+}
+
 //---future data structure---//
 
 int new_future(lua_State *L) {
@@ -689,7 +955,78 @@ int hpx_future_clean(lua_State *L) {
     return 1;
 }
 
+//--- A task started by async() here can be told to stop. The token
+//--- sits in the uservalue of the future that async() returned, and
+//--- while the task runs, in the registry of its VM.
+typedef std::shared_ptr<std::atomic<bool> > cancel_ptr;
+static char cancel_key;
+
+int hpx_cancel_clean(lua_State *L) {
+    if(cmp_meta(L,-1,cancel_metatable_name)) {
+      cancel_ptr *c = (cancel_ptr *)lua_touserdata(L,-1);
+      dtor(c);
+    }
+    return 1;
+}
+
+//--- Uservalues must be tables in Lua 5.2, so the token is wrapped
+void attach_cancel(lua_State *L,int index,cancel_ptr c) {
+  index = lua_absindex(L,index);
+  lua_createtable(L,1,0);
+  char *mem = (char *)lua_newuserdata(L,sizeof(cancel_ptr));
+  new (mem) cancel_ptr(c);
+  luaL_setmetatable(L,cancel_metatable_name);
+  lua_rawseti(L,-2,1);
+  lua_setuservalue(L,index);
+}
+
+cancel_ptr get_cancel(lua_State *L,int index) {
+  cancel_ptr c;
+  lua_getuservalue(L,index);
+  if(lua_istable(L,-1)) {
+    lua_rawgeti(L,-1,1);
+    if(cmp_meta(L,-1,cancel_metatable_name))
+      c = *(cancel_ptr *)lua_touserdata(L,-1);
+    lua_pop(L,1);
+  }
+  lua_pop(L,1);
+  return c;
+}
+
+//--- Whether the task running in this VM was cancelled
+bool task_cancelled(lua_State *L) {
+  lua_rawgetp(L,LUA_REGISTRYINDEX,&cancel_key);
+  std::atomic<bool> *c = (std::atomic<bool> *)lua_touserdata(L,-1);
+  lua_pop(L,1);
+  return c != nullptr && c->load();
+}
+
+void cancel_hook(lua_State *L,lua_Debug *ar) {
+  if(task_cancelled(L))
+    luaL_error(L,"task cancelled");
+}
+
+//--- f:Cancel() asks the task behind f to stop. It checks every
+//--- xlua.cancel.interval instructions and in Get(), and f then has
+//--- no values. Returns false for futures that can't be cancelled.
+int hpx_future_cancel(lua_State *L) {
+  if(!cmp_meta(L,1,future_metatable_name))
+    return 0;
+  cancel_ptr c = get_cancel(L,1);
+  lua_pop(L,lua_gettop(L));
+  if(c.get() != nullptr)
+    c->store(true);
+  lua_pushboolean(L,c.get() != nullptr);
+  return 1;
+}
+
+boost::chrono::microseconds to_duration(double seconds) {
+  return boost::chrono::microseconds(boost::int64_t(seconds*1e6));
+}
+
 int hpx_future_get(lua_State *L) {
+  if(task_cancelled(L))
+    return luaL_error(L,"task cancelled");
   if(cmp_meta(L,-1,future_metatable_name)) {
     future_type *fnc = (future_type *)lua_touserdata(L,-1);
     lua_pop(L,1);
@@ -708,12 +1045,48 @@ int hpx_future_get(lua_State *L) {
   return lua_gettop(L);
 }
 
+//--- f:GetFor(seconds) is f:Get() if f is ready within seconds,
+//--- nil and "timeout" otherwise, nil and "invalid future" if f has no
+//--- shared state
+int hpx_future_get_for(lua_State *L) {
+  if(!cmp_meta(L,1,future_metatable_name) || !lua_isnumber(L,2))
+    return 0;
+  future_type f = *(future_type *)lua_touserdata(L,1);
+  double seconds = lua_tonumber(L,2);
+  if(!f.valid()) {
+    lua_pop(L,lua_gettop(L));
+    lua_pushnil(L);
+    lua_pushstring(L,"invalid future");
+    return 2;
+  }
+  if(f.wait_for(to_duration(seconds)) != hpx::lcos::future_status::ready) {
+    lua_pop(L,lua_gettop(L));
+    lua_pushnil(L);
+    lua_pushstring(L,"timeout");
+    return 2;
+  }
+  lua_pop(L,1);
+  return hpx_future_get(L);
+}
+
 ptr_type luax_async2(
     closure_ptr cl,
     ptr_type args);
+ptr_type luax_async_cancellable(
+    closure_ptr cl,
+    ptr_type args,
+    cancel_ptr cancelled);
 
+//--- wait_all(f1,...,fn[,seconds]) or wait_all(t[,seconds]). With a
+//--- time limit it returns whether everything was ready in time.
 int luax_wait_all(lua_State *L) {
   int nargs = lua_gettop(L);
+  double timeout = -1;
+  if(nargs > 0 && lua_type(L,nargs) == LUA_TNUMBER) {
+    timeout = lua_tonumber(L,nargs);
+    lua_pop(L,1);
+    nargs--;
+  }
   std::vector<future_type> v;
   for(int i=1;i<=nargs;i++) {
     if(lua_istable(L,i) && nargs==1) {
@@ -750,6 +1123,19 @@ int luax_wait_all(lua_State *L) {
     }
   }
 
+  // Buffered component writes and writes to globals still on their
+  // way to other localities are part of what we wait for
+  flush_write_buffers(v);
+  flush_global_writes(v);
+
+  if(timeout >= 0) {
+    bool ready = hpx::when_all(v).wait_for(to_duration(timeout))
+      == hpx::lcos::future_status::ready;
+    lua_pop(L,lua_gettop(L));
+    lua_pushboolean(L,ready);
+    return 1;
+  }
+
   new_future(L);
   future_type *fc =
     (future_type *)lua_touserdata(L,-1);
@@ -936,10 +1322,12 @@ int hpx_future_then(lua_State *L) {
     h.var = *fnc;
     h.push(args);
 
+    cancel_ptr c{new std::atomic<bool>(false)};
     new_future(L);
     future_type *fc =
       (future_type *)lua_touserdata(L,-1);
-    *fc = fnc->then(boost::bind(luax_async2,cl,args));
+    *fc = fnc->then(boost::bind(luax_async_cancellable,cl,args,c));
+    attach_cancel(L,-1,c);
   }
   return 1;
 }
@@ -952,6 +1340,8 @@ int future_name(lua_State *L) {
 int open_future(lua_State *L) {
     static const struct luaL_Reg future_meta_funcs [] = {
         {"Get",&hpx_future_get},
+        {"GetFor",&hpx_future_get_for},
+        {"Cancel",&hpx_future_cancel},
         {"Then",&hpx_future_then},
         {"Name",future_name},
         {NULL,NULL},
@@ -974,6 +1364,12 @@ int open_future(lua_State *L) {
 
     lua_pop(L,1);
 
+    luaL_newmetatable(L,cancel_metatable_name);
+    lua_pushstring(L,"__gc");
+    lua_pushcfunction(L,hpx_cancel_clean);
+    lua_settable(L,-3);
+    lua_pop(L,1);
+
     return 1;
 }
 
@@ -1117,12 +1513,20 @@ int open_hpx(lua_State *L) {
 
     static const struct luaL_Reg hpx_funcs [] = {
         {"async",async},
+        {"async_at",async_at},
         {"start",xlua_start},
         {"stop",xlua_stop},
         {"get_mtable",get_mtable},
         {"discover_counter_types",discover},
         {"get_counter",xlua_get_counter},
         {"get_value",xlua_get_value}, // xxx
+        {"least_loaded",xlua_least_loaded},
+        {"coalescing_stats",xlua_coalescing_stats},
+        {"set_coalescing",xlua_set_coalescing},
+        {"broadcast",xlua_broadcast},
+        {"gather",xlua_gather},
+        {"reduce",xlua_reduce},
+        {"all_reduce",xlua_all_reduce},
         {NULL, NULL}
     };
 
@@ -1323,6 +1727,7 @@ bool loadFunc(lua_State *L) {
     */
     // TODO FIX
     #if 0
+    table_ptr globals = get_globals();
     auto search = globals->t.find(func);
     if(search != globals->t.end() && search->second.var.which() == Holder::bytecode_t) {
       Bytecode bytecode = boost::get<Bytecode>(search->second.var);
@@ -1440,6 +1845,7 @@ ptr_type luax_dataflow2(
       }
       #if 0
       if(!found) {
+        table_ptr globals = get_globals();
         auto search = globals->t.find(*fname);
         if(search != globals->t.end() && search->second.var.which() == Holder::bytecode_t) {
           Bytecode bytecode = boost::get<Bytecode>(search->second.var);
@@ -1451,12 +1857,12 @@ ptr_type luax_dataflow2(
       #endif
 
       if(!found) {
-        if(function_registry.find(*fname) == function_registry.end()) {
+        std::string bytecode;
+        if(!find_function(*fname,bytecode)) {
           std::cout << "Function '" << *fname << "' is not defined(3)." << std::endl;
           return answers;
         }
 
-        std::string bytecode = function_registry[*fname];
         if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,fname->c_str(),"b") != 0) {
           std::cout << "Error in function: '" << *fname << "' size=" << bytecode.size() << std::endl;
           SHOW_ERROR(L);
@@ -1513,7 +1919,17 @@ ptr_type luax_dataflow2(
 ptr_type luax_async2(
     closure_ptr cl,
     ptr_type args) {
+  return luax_async_cancellable(cl,args,cancel_ptr());
+}
+
+ptr_type luax_async_cancellable(
+    closure_ptr cl,
+    ptr_type args,
+    cancel_ptr cancelled) {
   ptr_type answers(new std::vector<Holder>());
+  if(cancelled.get() != nullptr && cancelled->load())
+    return answers;
+  args = import_futures(args);
 
   {
     LuaEnv lenv;
@@ -1555,10 +1971,10 @@ ptr_type luax_async2(
       }
       if(!found) {
         std::string skey = cl->code.data + "{s}";
-        auto search = globals->t.find(cl->code.data);
-        if(search != globals->t.end()) {
-          if(search->second.var.which() == Holder::bytecode_t) {
-            Bytecode bytecode = boost::get<Bytecode>(search->second.var);
+        Holder g;
+        if(find_global(cl->code.data,g)) {
+          if(g.var.which() == Holder::bytecode_t) {
+            Bytecode bytecode = boost::get<Bytecode>(g.var);
             int rc = lua_load(L,(lua_Reader)lua_read,(void *)&bytecode.data,0,"b");
             if(rc == LUA_OK) {
               found = true;
@@ -1570,12 +1986,12 @@ ptr_type luax_async2(
       }
 
       if(!found) {
-        if(function_registry.find(cl->code.data) == function_registry.end()) {
+        std::string bytecode;
+        if(!find_function(cl->code.data,bytecode)) {
           std::cout << "Function '" << cl->code.data << "' is not defined." << std::endl;
           return answers;
         }
 
-        std::string bytecode = function_registry[cl->code.data];
         if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,cl->code.data.c_str(),"b") != 0) {
           std::cout << "Error in function: '" << cl->code.data << "' size=" << bytecode.size() << std::endl;
           SHOW_ERROR(L);
@@ -1592,9 +2008,26 @@ ptr_type luax_async2(
       i->unpack(L);
     }
 
+    if(cancelled.get() != nullptr) {
+      static int interval = config_int("xlua.cancel.interval",10000);
+      lua_pushlightuserdata(L,cancelled.get());
+      lua_rawsetp(L,LUA_REGISTRYINDEX,&cancel_key);
+      lua_sethook(L,cancel_hook,LUA_MASKCOUNT,interval);
+    }
+
     const int max_output_args = 10;
-    if(lua_pcall(L,args->size(),max_output_args,0) != 0) {
+    int rc = lua_pcall(L,args->size(),max_output_args,0);
+    if(cancelled.get() != nullptr) {
+      lua_sethook(L,nullptr,0,0);
+      lua_pushnil(L);
+      lua_rawsetp(L,LUA_REGISTRYINDEX,&cancel_key);
+    }
+    if(rc != 0) {
       //std::cout << msg.str();
+      if(cancelled.get() != nullptr && cancelled->load()) {
+        lua_pop(L,lua_gettop(L));
+        return answers;
+      }
       SHOW_ERROR(L);
       return answers;
     }
@@ -1617,10 +2050,200 @@ ptr_type luax_async2(
   return answers;
 }
 
+//--- Futures handed to other localities. Each is kept until all its
+//--- consumers fetched it, or release_exported() is called once the
+//--- tasks it was sent to are done, whichever comes first.
+struct exported_future {
+  future_type f;
+  std::size_t consumers;
+};
+std::map<boost::uint64_t,exported_future> exported_futures;
+boost::uint64_t exported_futures_key = 0;
+hpx::lcos::local::spinlock exported_futures_mtx;
+
+//--- Called by the receiving locality, waits here without blocking
+//--- anyone else
+ptr_type fetch_exported(boost::uint64_t key) {
+  future_type f;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lock(exported_futures_mtx);
+    auto search = exported_futures.find(key);
+    if(search == exported_futures.end())
+      return ptr_type(new std::vector<Holder>());
+    f = search->second.f;
+    if(--search->second.consumers == 0)
+      exported_futures.erase(search);
+  }
+  return f.get();
+}
+
+void release_exported(const export_keys& keys) {
+  std::lock_guard<hpx::lcos::local::spinlock> lock(exported_futures_mtx);
+  for(auto k=keys.begin();k != keys.end();++k)
+    exported_futures.erase(*k);
+}
+
+//--- The type of a value in h, or in a table or closure it holds,
+//--- that only exists on this locality, or nullptr
+const char *local_only_type(const Holder& h,std::set<const table_inner *>& seen) {
+  switch(h.var.which()) {
+  case Holder::ctable_t:
+    return ctable_metatable_name;
+  case Holder::chan_t:
+    return channel_metatable_name;
+  case Holder::sync_t:
+    return boost::get<sync_ptr>(h.var)->reusable ?
+      barrier_metatable_name : latch_metatable_name;
+  case Holder::table_t: {
+    const table_ptr& tp = boost::get<table_ptr>(h.var);
+    if(!seen.insert(tp.get()).second)
+      return nullptr;
+    for(auto i=tp->t.begin();i != tp->t.end();++i) {
+      const char *t = local_only_type(i->second,seen);
+      if(t != nullptr)
+        return t;
+    }
+    return nullptr;
+  }
+  case Holder::closure_t: {
+    const closure_ptr& cp = boost::get<closure_ptr>(h.var);
+    for(auto i=cp->vars.begin();i != cp->vars.end();++i) {
+      const char *t = local_only_type(i->val,seen);
+      if(t != nullptr)
+        return t;
+    }
+    return nullptr;
+  }
+  }
+  return nullptr;
+}
+
+//--- Report a value that can't be sent to another locality, before
+//--- its serialization fails
+bool check_exportable(const Holder& h) {
+  std::set<const table_inner *> seen;
+  const char *t = local_only_type(h,seen);
+  if(t != nullptr) {
+    luai_writestringerror("A '%s' can't be sent to another locality ",t);
+    return false;
+  }
+  return true;
+}
+
+bool check_exportable(ptr_type args,closure_ptr cl) {
+  if(cl.get() != nullptr) {
+    Holder h;
+    h.var = cl;
+    if(!check_exportable(h))
+      return false;
+  }
+  for(auto i=args->begin();i != args->end();++i) {
+    if(!check_exportable(*i))
+      return false;
+  }
+  return true;
+}
+
+//--- Replace a future in h that isn't ready yet with a ref, also in
+//--- the tables h holds. A table with one is copied, not changed, it
+//--- is still the caller's. Returns whether h changed.
+bool export_holder(Holder& h,std::size_t consumers,export_keys& keys,
+    std::set<const table_inner *>& seen) {
+  if(h.var.which() == Holder::fut_t) {
+    future_type& f = boost::get<future_type>(h.var);
+    if(f.is_ready())
+      return false;
+    future_ref ref;
+    ref.loc = hpx::find_here();
+    {
+      std::lock_guard<hpx::lcos::local::spinlock> lock(exported_futures_mtx);
+      ref.key = ++exported_futures_key;
+      exported_future& e = exported_futures[ref.key];
+      e.f = f;
+      e.consumers = consumers;
+    }
+    keys.push_back(ref.key);
+    h.var = ref;
+    return true;
+  }
+  if(h.var.which() != Holder::table_t)
+    return false;
+  const table_ptr& tp = boost::get<table_ptr>(h.var);
+  if(!seen.insert(tp.get()).second)
+    return false;
+  table_ptr copy;
+  for(auto i=tp->t.begin();i != tp->t.end();++i) {
+    Holder v = i->second;
+    if(export_holder(v,consumers,keys,seen)) {
+      if(copy.get() == nullptr)
+        copy.reset(new table_inner(*tp));
+      copy->t[i->first] = v;
+    }
+  }
+  if(copy.get() == nullptr)
+    return false;
+  h.var = copy;
+  return true;
+}
+
+//--- Replace the futures in args that aren't ready yet with refs, so
+//--- sending args doesn't wait for them. consumers is the number of
+//--- localities args go to, keys gets the refs made for release_exported().
+void export_futures(ptr_type args,export_keys& keys,std::size_t consumers) {
+  std::set<const table_inner *> seen;
+  for(auto i=args->begin();i != args->end();++i)
+    export_holder(*i,consumers,keys,seen);
+}
+
+future_type resolve_future_ref(const future_ref& ref);
+
+bool import_holder(Holder& h,std::set<const table_inner *>& seen) {
+  if(h.var.which() == Holder::fref_t) {
+    h.var = resolve_future_ref(boost::get<future_ref>(h.var));
+    return true;
+  }
+  if(h.var.which() != Holder::table_t)
+    return false;
+  const table_ptr& tp = boost::get<table_ptr>(h.var);
+  if(!seen.insert(tp.get()).second)
+    return false;
+  table_ptr copy;
+  for(auto i=tp->t.begin();i != tp->t.end();++i) {
+    Holder v = i->second;
+    if(import_holder(v,seen)) {
+      if(copy.get() == nullptr)
+        copy.reset(new table_inner(*tp));
+      copy->t[i->first] = v;
+    }
+  }
+  if(copy.get() == nullptr)
+    return false;
+  h.var = copy;
+  return true;
+}
+
+//--- Turn refs received from another locality back into futures. The
+//--- result is a copy if there were any, a collective run here shares
+//--- args with what is sent to the others.
+ptr_type import_futures(ptr_type args) {
+  std::set<const table_inner *> seen;
+  ptr_type out;
+  for(std::size_t i=0;i<args->size();i++) {
+    Holder h = (*args)[i];
+    if(import_holder(h,seen)) {
+      if(out.get() == nullptr)
+        out.reset(new std::vector<Holder>(*args));
+      (*out)[i] = h;
+    }
+  }
+  return out.get() == nullptr ? args : out;
+}
+
 //--- Realize futures in inputs, call dataflow function, realize futures in outputs
 future_type luax_dataflow(
     string_ptr fname,
     ptr_type args) {
+    args = import_futures(args);
     // wait for all futures in input
     hpx::future<std::shared_ptr<std::vector<ptr_type> > > f1 = realize_when_all_inputs(args);
     // pass values of all futures along with args
@@ -1629,49 +2252,189 @@ future_type luax_dataflow(
     return f2.then(hpx::util::unwrapped(boost::bind(realize_when_all_outputs,_1)));
 }
 
-int remote_reg(std::map<std::string,std::string> registry);
+//--- Scheduling options for a task started here, from the options
+//--- table of async() and dataflow()
+struct task_options {
+  int level = 1; // 0 high, 1 normal, 2 low
+  int hint = -1; // the worker asked for, -1 for any
+  hpx::threads::thread_priority priority = hpx::threads::thread_priority_normal;
+  std::size_t worker = std::size_t(-1); // any
+  const char *name = "xlua_async";
+};
+
+//--- HPX keeps a task's name by pointer, so a name with a worker in
+//--- it is made once and kept
+const char *task_name(const char *base,std::size_t worker) {
+  static std::set<std::string> names;
+  static hpx::lcos::local::spinlock mtx;
+  std::string name = std::string(base) + "@" + std::to_string(worker);
+  std::lock_guard<hpx::lcos::local::spinlock> lock(mtx);
+  return names.insert(name).first->c_str();
+}
+
+//--- The options for level and hint on this locality. The name has
+//--- both, e.g. xlua_async_high@3 for worker 3.
+task_options make_task_options(bool dataflow,int level,int hint) {
+  static const char *names[2][3] = {
+    {"xlua_async_high","xlua_async","xlua_async_low"},
+    {"xlua_dataflow_high","xlua_dataflow","xlua_dataflow_low"}
+  };
+  static const hpx::threads::thread_priority priorities[3] = {
+    hpx::threads::thread_priority_high,
+    hpx::threads::thread_priority_normal,
+    hpx::threads::thread_priority_low
+  };
+  task_options opts;
+  opts.level = level;
+  opts.hint = hint;
+  opts.priority = priorities[level];
+  opts.name = names[dataflow ? 1 : 0][level];
+  if(hint >= 0) {
+    opts.worker = std::size_t(hint) % hpx::get_os_thread_count();
+    opts.name = task_name(opts.name,opts.worker);
+  }
+  return opts;
+}
+
+//--- Like hpx::async(f), but with the priority and worker hint. The
+//--- name shows in thread counters and profiles.
+hpx::future<ptr_type> spawn_task(const task_options& opts,boost::function<ptr_type()> f) {
+  promise_ptr p{new hpx::lcos::local::promise<ptr_type>()};
+  hpx::future<ptr_type> result = p->get_future();
+  hpx::applier::register_thread_nullary(
+    [p,f]() {
+      try {
+        p->set_value(f());
+      } catch(...) {
+        p->set_exception(boost::current_exception());
+      }
+    },
+    opts.name,hpx::threads::pending,true,opts.priority,opts.worker);
+  return result;
+}
+
+//--- luax_dataflow, with the function body run as set by opts
+future_type luax_dataflow_opts(
+    task_options opts,
+    string_ptr fname,
+    ptr_type args) {
+    args = import_futures(args);
+    hpx::future<std::shared_ptr<std::vector<ptr_type> > > f1 = realize_when_all_inputs(args);
+    hpx::future<ptr_type> f2 = f1.then(
+      [opts,fname,args](hpx::future<std::shared_ptr<std::vector<ptr_type> > > f) {
+        return spawn_task(opts,boost::bind(luax_dataflow2,fname,args,f.get()));
+      });
+    return f2.then(hpx::util::unwrapped(boost::bind(realize_when_all_outputs,_1)));
+}
+
+//--- async(loc,options,...) and dataflow(loc,options,...) apply the
+//--- options on loc
+hpx::future<ptr_type> luax_async_opts(int level,int hint,closure_ptr cl,ptr_type args) {
+  return spawn_task(make_task_options(false,level,hint),boost::bind(luax_async2,cl,args));
+}
+
+future_type luax_dataflow_at(int level,int hint,string_ptr fname,ptr_type args) {
+  return luax_dataflow_opts(make_task_options(true,level,hint),fname,args);
+}
+
+int remote_reg(std::map<std::string,std::string> delta,std::size_t version,boost::uint32_t origin);
 
 }
 
 HPX_PLAIN_ACTION(hpx::luax_dataflow,luax_dataflow_action);
 HPX_PLAIN_ACTION(hpx::luax_async2,luax_async_action);
+HPX_PLAIN_ACTION(hpx::luax_async_opts,luax_async_opts_action);
+HPX_PLAIN_ACTION(hpx::luax_dataflow_at,luax_dataflow_opts_action);
 HPX_PLAIN_ACTION(hpx::remote_reg,remote_reg_action);
 HPX_REGISTER_BROADCAST_ACTION_DECLARATION(remote_reg_action);
 HPX_REGISTER_BROADCAST_ACTION(remote_reg_action);
+HPX_PLAIN_ACTION(hpx::fetch_exported,fetch_exported_action);
+
+// Bursts of small calls to one locality go out in fewer messages.
+// Tuned by hpx.plugins.coalescing_message_handlers.{num_messages,interval}
+#if defined(HPX_HAVE_PARCEL_COALESCING)
+HPX_ACTION_USES_MESSAGE_COALESCING(luax_async_action);
+HPX_ACTION_USES_MESSAGE_COALESCING(luax_dataflow_action);
+#endif
 
 namespace hpx {
 
-int luax_run_guarded(lua_State *L) {
-  int n = lua_gettop(L);
-  CHECK_STRING(-1,"run_guarded")
-  string_ptr fname(new std::string(lua_tostring(L,-1)));
-  guard_type g;
-  if(n == 1) {
-    g = global_guarded;
-  } else if(n == 2) {
-    g = *(guard_type *)lua_touserdata(L,-2);
-  } else if(n > 2) {
-    std::shared_ptr<hpx::lcos::local::guard_set> gs{new hpx::lcos::local::guard_set()};
-    ptr_type all_data{new std::vector<Holder>()};
+future_type resolve_future_ref(const future_ref& ref) {
+  if(ref.loc == hpx::find_here())
+    return hpx::async(fetch_exported,ref.key);
+  return hpx::async<fetch_exported_action>(ref.loc,ref.key);
+}
 
-    guard_type *gv = new guard_type[n];
-    for(int i=1;i<n;i++) {
-      guard_type g2 = *(guard_type *)lua_touserdata(L,i);
-      gv[i-1]=g2;
-      gs->add(g2->g);
+//--- The guards and their data for run_guarded(g1,...,gn,fname), or
+//--- the global guard if none are given
+bool get_guards(lua_State *L,const char *name,std::vector<guard_type>& gv,ptr_type& gdata) {
+  int n = lua_gettop(L);
+  if(!lua_isstring(L,n)) {
+    luai_writestringerror("Argument to '%s' is not a string ",name);
+    return false;
+  }
+  for(int i=1;i<n;i++) {
+    if(!cmp_meta(L,i,guard_metatable_name)) {
+      luai_writestringerror("Argument to '%s' is not a guard ",name);
+      return false;
+    }
+    gv.push_back(*(guard_type *)lua_touserdata(L,i));
+  }
+  if(gv.size() == 0)
+    gv.push_back(global_guarded);
+  if(gv.size() == 1) {
+    gdata = gv[0]->g_data;
+  } else {
+    gdata.reset(new std::vector<Holder>());
+    for(auto g = gv.begin();g != gv.end();++g) {
       Holder h;
-      h.var = g2->g_data;
-      all_data->push_back(h);
+      h.var = (*g)->g_data;
+      gdata->push_back(h);
     }
-    boost::function<void()> func = boost::bind(hpx_srun,fname,all_data,gv,n);
+  }
+  return true;
+}
+
+//--- run_guarded(g1,...,gn,fname) calls fname with the guarded data
+//--- once no other run_guarded holds any of the guards, and stores
+//--- its results back in them. The future has the results too.
+int luax_run_guarded(lua_State *L) {
+  std::vector<guard_type> gv;
+  ptr_type gdata;
+  if(!get_guards(L,"run_guarded",gv,gdata))
+    return 0;
+  string_ptr fname(new std::string(lua_tostring(L,-1)));
+  lua_pop(L,lua_gettop(L));
+  promise_ptr done{new hpx::lcos::local::promise<ptr_type>()};
+  future_type f = done->get_future();
+  boost::function<void()> func = boost::bind(hpx_srun,fname,gdata,gv,done);
+  if(gv.size() == 1) {
+    run_guarded(*gv[0]->g,func);
+  } else {
+    std::shared_ptr<hpx::lcos::local::guard_set> gs{new hpx::lcos::local::guard_set()};
+    for(auto g = gv.begin();g != gv.end();++g)
+      gs->add((*g)->g);
     run_guarded(*gs,func);
-    return 1;
   }
-  lua_pop(L,n);
-  guard_type *gv = new guard_type[1];
-  gv[0] = g;
-  boost::function<void()> func = boost::bind(hpx_srun,fname,g->g_data,gv,1);
-  run_guarded(*g->g,func);
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = f;
+  return 1;
+}
+
+//--- run_guarded_shared(g1,...,gn,fname) is for sections that only
+//--- read the guarded data. They run together with each other, but
+//--- not with run_guarded. The results are only in the future.
+int luax_run_guarded_shared(lua_State *L) {
+  std::vector<guard_type> gv;
+  ptr_type gdata;
+  if(!get_guards(L,"run_guarded_shared",gv,gdata))
+    return 0;
+  string_ptr fname(new std::string(lua_tostring(L,-1)));
+  lua_pop(L,lua_gettop(L));
+  new_future(L);
+  future_type *fc = (future_type *)lua_touserdata(L,-1);
+  *fc = hpx::async(hpx_srun_shared,fname,gdata,gv);
   return 1;
 }
 
@@ -1719,6 +2482,76 @@ int islocality(lua_State *L) {
     return 1;
 }
 
+//--- A table with no keys other than priority and hint. Any other
+//--- table, e.g. from unwrapped(...), is the function to run.
+bool is_options_table(lua_State *L,int index) {
+  if(lua_type(L,index) != LUA_TTABLE)
+    return false;
+  bool options = true;
+  lua_pushnil(L);
+  while(lua_next(L,index) != 0) {
+    lua_pop(L,1);
+    if(lua_type(L,-1) != LUA_TSTRING) {
+      options = false;
+    } else {
+      std::string key = lua_tostring(L,-1);
+      if(key != "priority" && key != "hint")
+        options = false;
+    }
+  }
+  return options;
+}
+
+//--- An options table, if the next argument is one:
+//---   {priority='high'|'normal'|'low', hint=worker}
+//--- Returns false after reporting a bad option.
+bool get_task_options(lua_State *L,int index,bool dataflow,task_options& opts,bool& given) {
+  given = is_options_table(L,index);
+  int level = 1, hint = -1;
+  if(given) {
+    lua_getfield(L,index,"priority");
+    if(lua_isstring(L,-1)) {
+      std::string s = lua_tostring(L,-1);
+      if(s == "high")
+        level = 0;
+      else if(s == "low")
+        level = 2;
+      else if(s != "normal") {
+        luai_writestringerror("Unknown priority '%s', use 'high', 'normal' or 'low' ",s.c_str());
+        lua_pop(L,1);
+        return false;
+      }
+    }
+    lua_pop(L,1);
+    lua_getfield(L,index,"hint");
+    if(lua_isnumber(L,-1) && lua_tonumber(L,-1) >= 0)
+      hint = lua_tointeger(L,-1);
+    lua_pop(L,1);
+    lua_remove(L,index);
+  }
+  opts = make_task_options(dataflow,level,hint);
+  return true;
+}
+
+//--- The function at index 1 and the arguments after it. An
+//--- unwrapped(...) table is run by "call", with the table first.
+closure_ptr pack_task_args(lua_State *L,ptr_type args) {
+  closure_ptr cl = getfunc(L,1);
+  if(cl->code.data == unwrapped_str) {
+    Holder h;
+    h.pack(L,1);
+    h.push(args);
+    cl->code.data = "call";
+  }
+  int nargs = lua_gettop(L);
+  for(int i=2;i<=nargs;i++) {
+    Holder h;
+    h.pack(L,i);
+    h.push(args);
+  }
+  return cl;
+}
+
 int dataflow(lua_State *L) {
 
     locality_type *loc = nullptr;
@@ -1726,31 +2559,33 @@ int dataflow(lua_State *L) {
       loc = (locality_type *)lua_touserdata(L,1);
       lua_remove(L,1);
     }
+    task_options opts;
+    bool given;
+    if(!get_task_options(L,1,true,opts,given))
+      return 0;
 
     // Package up the arguments
     ptr_type args(new std::vector<Holder>());
-    int nargs = lua_gettop(L);
-    for(int i=2;i<=nargs;i++) {
-      Holder h;
-      h.pack(L,i);
-      h.push(args);
-    }
-    
     string_ptr fname(new std::string);
-    closure_ptr cl = getfunc(L,1);
-    *fname = cl->code.data;
-    if(*fname == unwrapped_str) {
-      Holder h;
-      h.pack(L,1);
-      h.push(args);
-      *fname = "call";
-    }
+    *fname = pack_task_args(L,args)->code.data;
 
     // Launch the thread
-    future_type f =
-      (loc == nullptr) ?
-        hpx::async(luax_dataflow,fname,args) :
-        hpx::async<luax_dataflow_action>(*loc,fname,args);
+    export_keys keys;
+    if(loc != nullptr) {
+      if(!check_exportable(args,closure_ptr()))
+        return 0;
+      export_futures(args,keys,1);
+    }
+    future_type f;
+    if(loc != nullptr && given)
+      f = release_after(hpx::async<luax_dataflow_opts_action>(
+        *loc,opts.level,opts.hint,fname,args),keys);
+    else if(loc != nullptr)
+      f = release_after(hpx::async<luax_dataflow_action>(*loc,fname,args),keys);
+    else if(given)
+      f = luax_dataflow_opts(opts,fname,args);
+    else
+      f = hpx::async(luax_dataflow,fname,args);
 
     new_future(L);
     future_type *fc =
@@ -1766,35 +2601,90 @@ int async(lua_State *L) {
       loc = (locality_type *)lua_touserdata(L,1);
       lua_remove(L,1);
     }
+    task_options opts;
+    bool given;
+    if(!get_task_options(L,1,false,opts,given))
+      return 0;
 
     // Package up the arguments
     ptr_type args(new std::vector<Holder>());
-    int nargs = lua_gettop(L);
-    
-    //CHECK_STRING(1,"async")
-    closure_ptr cl = getfunc(L,1);
-    if(cl->code.data == unwrapped_str) {
-      Holder h;
-      h.pack(L,1);
-      h.push(args);
-      cl->code.data = "call";
+    closure_ptr cl = pack_task_args(L,args);
+
+    // Launch the thread, only tasks run here can be cancelled
+    cancel_ptr c;
+    export_keys keys;
+    if(loc != nullptr) {
+      if(!check_exportable(args,cl))
+        return 0;
+      export_futures(args,keys,1);
+    } else {
+      c.reset(new std::atomic<bool>(false));
     }
-    for(int i=2;i<=nargs;i++) {
-      Holder h;
-      h.pack(L,i);
-      h.push(args);
+    future_type f =
+      (loc != nullptr && given) ?
+        release_after(hpx::async<luax_async_opts_action>(
+          *loc,opts.level,opts.hint,cl,args),keys) :
+      (loc != nullptr) ?
+        release_after(hpx::async<luax_async_action>(*loc,cl,args),keys) :
+      given ?
+        spawn_task(opts,boost::bind(luax_async_cancellable,cl,args,c)) :
+        hpx::async(luax_async_cancellable,cl,args,c);
+
+    new_future(L);
+    future_type *fc =
+      (future_type *)lua_touserdata(L,-1);
+    *fc = f;
+    if(c.get() != nullptr)
+      attach_cancel(L,-1,c);
+    return 1;
+}
+
+//--- Where obj lives: a component's current locality, as known to
+//--- AGAS, or here for data that only exists in this VM
+hpx::naming::id_type locality_of(lua_State *L,int index) {
+  if(cmp_meta(L,index,lua_client_metatable_name)) {
+    lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,index);
+    return hpx::get_colocation_id_sync(lcp->id);
+  } else if(cmp_meta(L,index,locality_metatable_name)) {
+    return *(locality_type *)lua_touserdata(L,index);
+  }
+  return hpx::find_here();
+}
+
+//--- async_at(obj,f,...) runs f(...) where obj lives. Run here, the
+//--- arguments are not copied, vector_t's and table_t's are shared.
+int async_at(lua_State *L) {
+    if(lua_gettop(L) < 2) {
+      luai_writestringerror("Too few arguments to '%s' ","async_at");
+      return 0;
     }
+    hpx::naming::id_type loc = locality_of(L,1);
+    lua_remove(L,1);
 
-    // Launch the thread
+    ptr_type args(new std::vector<Holder>());
+    closure_ptr cl = pack_task_args(L,args);
+
+    bool here = loc == hpx::find_here();
+    cancel_ptr c;
+    export_keys keys;
+    if(!here) {
+      if(!check_exportable(args,cl))
+        return 0;
+      export_futures(args,keys,1);
+    } else {
+      c.reset(new std::atomic<bool>(false));
+    }
     future_type f =
-      (loc == nullptr) ?
-        hpx::async(luax_async2,cl,args) :
-        hpx::async<luax_async_action>(*loc,cl,args);
+      here ?
+        hpx::async(luax_async_cancellable,cl,args,c) :
+        release_after(hpx::async<luax_async_action>(loc,cl,args),keys);
 
     new_future(L);
     future_type *fc =
       (future_type *)lua_touserdata(L,-1);
     *fc = f;
+    if(c.get() != nullptr)
+      attach_cancel(L,-1,c);
     return 1;
 }
 
@@ -1822,21 +2712,10 @@ int unwrap(lua_State *L) {
     return 1;
 }
 
-int remote_reg(std::map<std::string,std::string> registry) {
-	LuaEnv lenv;
-    lua_State *L = lenv.get_state();
-	function_registry = registry;
-	for(auto i = registry.begin();i != registry.end();++i) {
-		std::string& bytecode = i->second;
-		if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,i->first.c_str(),"b") != 0) {
-			std::cout << "Error in function: " << i->first << " size=" << bytecode.size() << std::endl;
-			SHOW_ERROR(L);
-			return -1;
-		}
-
-		lua_setglobal(L,i->first.c_str());
-	}
-	return 0;
+int remote_reg(std::map<std::string,std::string> delta,std::size_t version,boost::uint32_t origin) {
+  // VMs pick up the new functions the next time they are acquired
+  publish_functions(delta,version,origin);
+  return 0;
 }
 
 // TODO: add wrappers to conveniently get and use tables?
@@ -1846,6 +2725,7 @@ int remote_reg(std::map<std::string,std::string> registry) {
 // The first is a script, the second a lib (named either power.so or libpower.so),
 // the third a function. 
 int hpx_reg(lua_State *L) {
+  registry_map changes;
 	while(lua_gettop(L)>0) {
     CHECK_STRING(-1,"HPX_PLAIN_ACTION")
 		if(lua_isstring(L,-1)) {
@@ -1854,8 +2734,14 @@ int hpx_reg(lua_State *L) {
 			lua_getglobal(L,fname.c_str());
       Bytecode bc;
 			lua_dump(L,(lua_Writer)lua_write,&bc.data,true);
-			function_registry[fname]=bc.data;
-      (globals->t)[fname].var = bc;
+      // Only ship functions that are new or changed
+      std::string old;
+      if(!find_function(fname,old) || old != bc.data)
+        changes[fname]=bc.data;
+      // The registry ships it to the other localities
+      Holder hbc;
+      hbc.var = bc;
+      set_global(fname,hbc,false);
 			//std::cout << "register(" << fname << "):size=" << bytecode.size() << std::endl;
 			const int nf = lua_gettop(L);
 			if(nf > n) {
@@ -1864,26 +2750,42 @@ int hpx_reg(lua_State *L) {
 		}
 		lua_pop(L,1);
 	}
+  if(changes.empty())
+    return 1;
+  std::size_t version = publish_functions(changes);
 
+  // broadcast() fans out as a tree, each receiver forwards to the next level
 	std::vector<hpx::naming::id_type> remote_localities = hpx::find_remote_localities();
   if(remote_localities.size() > 0) {
-    auto f = hpx::lcos::broadcast<remote_reg_action>(remote_localities,function_registry);
+    auto f = hpx::lcos::broadcast<remote_reg_action>(
+      remote_localities,changes,version,hpx::get_locality_id());
     f.get(); // in case there are exceptions
   }
   
 	return 1;
 }
 
-void hpx_srun(string_ptr fname,ptr_type gdata,guard_type *gv,int ng) {
-    LuaEnv lenv;
-    lua_State *L = lenv.get_state();
+//--- Locks are always taken in address order, or a reader and a
+//--- writer sharing two guards could each wait for the other
+std::vector<guard_type> lock_order(std::vector<guard_type> gv) {
+  std::sort(gv.begin(),gv.end(),[](const guard_type& a,const guard_type& b) {
+    return a->rw.get() < b->rw.get();
+  });
+  gv.erase(std::unique(gv.begin(),gv.end(),[](const guard_type& a,const guard_type& b) {
+    return a->rw == b->rw;
+  }),gv.end());
+  return gv;
+}
+
+//--- Run fname with the guarded data as arguments, return what it
+//--- returns without the trailing nils
+ptr_type hpx_srun_section(lua_State *L,string_ptr fname,ptr_type gdata) {
     int n = lua_gettop(L);
     lua_pop(L,n);
     for(auto i=gdata->begin();i!=gdata->end();++i) {
       i->unpack(L);
     }
     hpx_srun(L,*fname,gdata);
-    gdata->clear();
 
     // Trim stack
     int nargs = lua_gettop(L);
@@ -1892,16 +2794,81 @@ void hpx_srun(string_ptr fname,ptr_type gdata,guard_type *gv,int ng) {
       nargs--;
     }
 
+    ptr_type results{new std::vector<Holder>()};
     for(int i=1;i<=nargs;i++) {
       Holder h;
       h.pack(L,i);
-      guard_type g;
-      int n = i <= ng ? i-1 : ng-1;
-      g = gv[n];
-      g->g_data->clear();
-      h.push(g->g_data);
+      results->push_back(h);
+    }
+    lua_pop(L,nargs);
+    return results;
+}
+
+//--- The locks of a section's guards, taken in lock_order and given
+//--- back in reverse even if the section throws
+struct guard_locks {
+  std::vector<guard_type> locks;
+  bool shared;
+
+  guard_locks(const std::vector<guard_type>& gv,bool shared_) : shared(shared_) {
+    std::vector<guard_type> order = lock_order(gv);
+    try {
+      for(auto g = order.begin();g != order.end();++g) {
+        if(shared)
+          (*g)->rw->lock_shared();
+        else
+          (*g)->rw->lock();
+        locks.push_back(*g);
+      }
+    } catch(...) {
+      release();
+      throw;
+    }
+  }
+  ~guard_locks() {
+    release();
+  }
+  void release() {
+    for(auto g = locks.rbegin();g != locks.rend();++g) {
+      if(shared)
+        (*g)->rw->unlock_shared();
+      else
+        (*g)->rw->unlock();
     }
-    delete[] gv;
+    locks.clear();
+  }
+};
+
+void hpx_srun(string_ptr fname,ptr_type gdata,std::vector<guard_type> gv,promise_ptr done) {
+  try {
+    ptr_type results;
+    {
+      guard_locks lock(gv,false);
+      {
+        LuaEnv lenv;
+        results = hpx_srun_section(lenv.get_state(),fname,gdata);
+      }
+      gdata->clear();
+
+      // Result i goes to guard i, any extra ones replace the last
+      // guard's data in turn
+      int ng = gv.size();
+      for(int i=0;i<(int)results->size();i++) {
+        guard_type g = gv[i < ng ? i : ng-1];
+        g->g_data->clear();
+        (*results)[i].push(g->g_data);
+      }
+    }
+    done->set_value(results);
+  } catch(...) {
+    done->set_exception(boost::current_exception());
+  }
+}
+
+ptr_type hpx_srun_shared(string_ptr fname,ptr_type gdata,std::vector<guard_type> gv) {
+  guard_locks lock(gv,true);
+  LuaEnv lenv;
+  return hpx_srun_section(lenv.get_state(),fname,gdata);
 }
 
 int hpx_run(lua_State *L) {
@@ -1913,12 +2880,12 @@ int hpx_run(lua_State *L) {
 
 int hpx_srun(lua_State *L,std::string& fname,ptr_type gdata) {
   int n = lua_gettop(L);
-  if(function_registry.find(fname) == function_registry.end()) {
+  std::string bytecode;
+  if(!find_function(fname,bytecode)) {
     std::cout << "Function '" << fname << "' is not defined(2)." << std::endl;
     return 0;
   }
 
-  std::string bytecode = function_registry[fname];
   if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,0,"b") != 0) {
     std::cout << "Error in function: " << fname << " size=" << bytecode.size() << std::endl;
     SHOW_ERROR(L);
@@ -8,6 +8,10 @@
 #include <map>
 #include <sstream>
 #include <hpx/include/lcos.hpp>
+#include <hpx/lcos/local/mutex.hpp>
+#include <hpx/lcos/local/spinlock.hpp>
+#include <deque>
+#include <functional>
 #include <atomic>
 #include <memory>
 #include <sstream>
@@ -15,6 +19,8 @@
 #include <boost/variant.hpp>
 #include <hpx/lcos/future.hpp>
 #include <hpx/lcos/local/composable_guard.hpp>
+#include <hpx/lcos/local/shared_mutex.hpp>
+#include <hpx/lcos/local/promise.hpp>
 #include <hpx/include/actions.hpp>
 #include <hpx/runtime/serialization/shared_ptr.hpp>
 #include <hpx/runtime/serialization/map.hpp>
@@ -34,6 +40,17 @@
 
 #define STACK show_stack(std::cout,L,__FILE__,__LINE__,true)
 
+#define CHECK_STRING(INDEX,NAME) \
+  if(!lua_isstring(L,INDEX)) { \
+    luai_writestringerror("Argument to '%s' is not a string ",NAME);\
+    return 0; \
+  }
+
+#ifndef luai_writestringerror
+#define luai_writestringerror(s,p) \
+        (fprintf(stderr, (s), (p)), fflush(stderr))
+#endif
+
 namespace hpx {
 
 extern const char *table_metatable_name;
@@ -43,6 +60,12 @@ extern const char *future_metatable_name;
 extern const char *guard_metatable_name;
 extern const char *locality_metatable_name;
 extern const char *lua_client_metatable_name;
+extern const char *dvector_metatable_name;
+extern const char *globals_metatable_name;
+extern const char *ctable_metatable_name;
+extern const char *channel_metatable_name;
+extern const char *latch_metatable_name;
+extern const char *barrier_metatable_name;
 
 std::ostream& show_stack(std::ostream& o,lua_State *L,const char *fname,int line,bool recurse=true);
 
@@ -109,22 +132,66 @@ typedef std::shared_ptr<table_inner> table_ptr;
 
 struct lua_aux_client {
   hpx::naming::id_type id;
+  // Run Call() on the parcel thread instead of a new HPX thread
+  bool direct_calls = false;
 
   lua_aux_client() {}
 
   hpx::future<ptr_type> get(std::string name);
 
+  // Returns {version} if the component hasn't changed since
+  // known_version, {version,value} otherwise
+  hpx::future<ptr_type> get_if_changed(std::string name,double known_version);
+
   hpx::future<ptr_type> call(closure_ptr cp,ptr_type ptargs);
 
+  hpx::future<ptr_type> call(closure_ptr cp,ptr_type ptargs,bool direct);
+
   hpx::future<ptr_type> set(std::string name,Holder h);
+
+  hpx::future<ptr_type> get_many(std::vector<std::string> names);
+
+  hpx::future<ptr_type> set_many(std::vector<std::string> names,std::vector<Holder> values);
+
+  // Elements lo..hi of a vector or table field, renumbered from 1
+  hpx::future<ptr_type> get_range(std::string name,int lo,int hi);
+
+  // Write a vector or table into a field starting at element lo
+  hpx::future<ptr_type> set_range(std::string name,int lo,Holder values);
+
+  void set_async(std::string name,Holder h);
 private:
   friend class hpx::serialization::access;
   template<class Archive>
     void serialize(Archive & ar, const unsigned int version)
     {
       ar & id;
+      ar & direct_calls;
     }
 };
+struct concurrent_table;
+typedef std::shared_ptr<concurrent_table> ctable_ptr;
+struct channel_inner;
+typedef std::shared_ptr<channel_inner> channel_ptr;
+struct sync_inner;
+typedef std::shared_ptr<sync_inner> sync_ptr;
+
+//--- Stands in for a future sent to another locality. The receiver
+//--- asks the locality holding the future for its value, so neither
+//--- side waits when the arguments are sent.
+struct future_ref {
+  hpx::naming::id_type loc;
+  boost::uint64_t key = 0;
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & loc;
+      ar & key;
+    }
+};
+
 typedef boost::variant<
   Empty,
   double,
@@ -136,7 +203,11 @@ typedef boost::variant<
   vector_ptr,
   hpx::naming::id_type,
   lua_aux_client,
-  closure_ptr
+  closure_ptr,
+  future_ref,
+  ctable_ptr,
+  channel_ptr,
+  sync_ptr
   > variant_type;
 
 struct table_iter_type {
@@ -146,18 +217,25 @@ struct table_iter_type {
 
 typedef std::vector<Holder> array_type;
 
+//--- Writers are queued on g, so they never block a worker. They
+//--- also hold rw exclusively while they run, which keeps out the
+//--- readers, who only take rw shared.
 struct Guard {
   std::shared_ptr<hpx::lcos::local::guard> g;
+  std::shared_ptr<hpx::lcos::local::shared_mutex> rw;
   ptr_type g_data;
-  Guard() : g(new hpx::lcos::local::guard()), g_data(new std::vector<Holder>()) {}
+  Guard() : g(new hpx::lcos::local::guard()),
+    rw(new hpx::lcos::local::shared_mutex()), g_data(new std::vector<Holder>()) {}
   ~Guard() {}
 };
 typedef std::shared_ptr<Guard> guard_type;
 
 typedef std::shared_ptr<std::string> string_ptr;
+typedef std::shared_ptr<hpx::lcos::local::promise<ptr_type> > promise_ptr;
 
 int hpx_srun(lua_State *L,std::string& fname,ptr_type p);
-void hpx_srun(string_ptr fname,ptr_type p,guard_type*,int);
+void hpx_srun(string_ptr fname,ptr_type p,std::vector<guard_type> gv,promise_ptr done);
+ptr_type hpx_srun_shared(string_ptr fname,ptr_type p,std::vector<guard_type> gv);
 
 extern guard_type global_guarded;
 
@@ -171,7 +249,7 @@ private:
       ar & var;
     }
 public:
-  enum utype { empty_t, num_t, fut_t, str_t, ptr_t, table_t, bytecode_t, vector_t, locality_t, client_t, closure_t };
+  enum utype { empty_t, num_t, fut_t, str_t, ptr_t, table_t, bytecode_t, vector_t, locality_t, client_t, closure_t, fref_t, ctable_t, chan_t, sync_t };
 
   variant_type var;
 
@@ -209,9 +287,115 @@ private:
     }
 };
 
+//--- A table tasks on one locality can write to at the same time.
+//--- Keys are spread over shards, each with its own lock, so writers
+//--- only wait for others using the same shard. It can't be sent to
+//--- another locality, the shards don't mean anything there.
+struct concurrent_table {
+  struct shard {
+    hpx::lcos::local::mutex mtx;
+    table_type t;
+    std::size_t version = 0; // bumped by every write, for Update
+  };
+  std::vector<std::unique_ptr<shard> > shards;
+
+  concurrent_table(std::size_t n=16) {
+    for(std::size_t i=0;i<n || i==0;i++)
+      shards.push_back(std::unique_ptr<shard>(new shard));
+  }
+
+  shard& get_shard(const key_type& key) {
+    std::size_t h = key.which() == 0 ?
+      std::hash<double>()(boost::get<double>(key)) :
+      std::hash<std::string>()(boost::get<std::string>(key));
+    return *shards[h % shards.size()];
+  }
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      HPX_THROW_EXCEPTION(hpx::invalid_status,"concurrent_table::serialize",
+        "a concurrent table can't be sent to another locality");
+    }
+};
+
+//--- A queue of values between tasks on one locality. Receivers that
+//--- find it empty, and senders that find a bounded one full, wait in
+//--- line for a promise. Like concurrent_table it can't be sent to
+//--- another locality.
+struct channel_inner {
+  typedef std::shared_ptr<hpx::lcos::local::promise<ptr_type> > waiter_type;
+
+  hpx::lcos::local::spinlock mtx;
+  std::deque<Holder> items;
+  std::deque<waiter_type> receivers;
+  std::deque<std::pair<Holder,waiter_type> > senders;
+  std::size_t capacity = 0; // 0 for unbounded
+  bool closed = false;
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      HPX_THROW_EXCEPTION(hpx::invalid_status,"channel_inner::serialize",
+        "a channel can't be sent to another locality");
+    }
+};
+
+//--- The state of a latch_t or barrier_t. The future is ready once
+//--- expected arrivals have been counted. A barrier then starts over
+//--- with a new promise, a latch stays ready.
+struct sync_inner {
+  hpx::lcos::local::spinlock mtx;
+  std::size_t expected = 0;
+  std::size_t arrived = 0;
+  bool reusable = false;
+  std::shared_ptr<hpx::lcos::local::promise<ptr_type> > done;
+  future_type ready;
+  std::string global_name; // set for a barrier across localities
+
+  // The default is for the serialization support, which builds the
+  // object before serialize() gets to throw
+  sync_inner() : sync_inner(0,false) {}
+  sync_inner(std::size_t n,bool reusable_) : expected(n), reusable(reusable_),
+    done(new hpx::lcos::local::promise<ptr_type>()), ready(done->get_future()) {}
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      HPX_THROW_EXCEPTION(hpx::invalid_status,"sync_inner::serialize",
+        "a latch or barrier can't be sent to another locality");
+    }
+};
+
 class Lua;
 
-extern std::map<std::string,std::string> function_registry;
+//--- The functions registered with HPX_PLAIN_ACTION. A snapshot is
+//--- never modified once published. Readers keep the snapshot they
+//--- loaded, writers publish a new one with a higher generation.
+typedef std::map<std::string,std::string> registry_map;
+struct registry_entry {
+  std::string bytecode;
+  std::size_t generation; // generation that added or changed it
+  std::size_t version;    // logical time of the registration,
+  boost::uint32_t origin; // and the locality that made it
+};
+struct function_registry_type {
+  std::map<std::string,registry_entry> functions;
+  std::size_t generation = 0;
+  std::size_t clock = 0;
+};
+typedef std::shared_ptr<const function_registry_type> registry_ptr;
+
+registry_ptr get_function_registry();
+bool find_function(const std::string& fname,std::string& bytecode);
+//--- Publish new or changed functions. Local registrations pass no
+//--- version and get the next one, which is returned. Deltas from
+//--- other localities only replace entries with an older version.
+std::size_t publish_functions(const registry_map& changes,
+  std::size_t version = 0,boost::uint32_t origin = 0);
 
 //--- A wrapper for the Lua object. Allows us to add state.
 class Lua {
@@ -219,6 +403,7 @@ public:
   std::atomic<bool> busy;
 private:
   lua_State *L;
+  std::size_t registry_generation;
   public:
   Lua();
   ~Lua() {
@@ -227,14 +412,23 @@ private:
   lua_State *get_state() {
     return L;
   }
+  //--- Load functions registered since the last call
+  void sync_registry();
 };
 Lua *get_lua_ptr();
 void set_lua_ptr(Lua *lua);
 
+//--- Construct n idle VMs on every worker thread. With n < 0 the
+//--- count is taken from the xlua.prewarm configuration entry.
+void prewarm_lua_vms(int n = -1);
+
 //--- Thread-specific ptr deletes objects on reset. Circumvent this.
+//--- Holds the idle VMs of one worker thread.
 struct LuaHolder {
-  Lua *held;
-  LuaHolder() { held = new Lua(); }
+  std::vector<Lua *> held;
+  // Cleared by the idle GC step, which may run on another worker
+  std::atomic<bool> gc_pending;
+  LuaHolder() : gc_pending(false) { held.push_back(new Lua()); }
   ~LuaHolder() {}
 };
 
@@ -9,12 +9,42 @@ int xlua_get_counter(lua_State *L);
 int xlua_get_value(lua_State *L);
 int xlua_start(lua_State *L);
 int xlua_stop(lua_State *L);
+int xlua_least_loaded(lua_State *L);
+int xlua_coalescing_stats(lua_State *L);
+int xlua_set_coalescing(lua_State *L);
+
+int xlua_broadcast(lua_State *L);
+int xlua_gather(lua_State *L);
+int xlua_reduce(lua_State *L);
+int xlua_all_reduce(lua_State *L);
+hpx::naming::id_type least_loaded_locality();
 
 int call(lua_State *L);
 int xlua_unwrapped(lua_State *L);
 int dataflow(lua_State *L);
 int make_ready_future(lua_State *L);
 int async(lua_State *L);
+int async_at(lua_State *L);
+bool check_exportable(const Holder& h);
+bool check_exportable(ptr_type args,closure_ptr cl);
+typedef std::vector<boost::uint64_t> export_keys;
+void export_futures(ptr_type args,export_keys& keys,std::size_t consumers);
+ptr_type import_futures(ptr_type args);
+void release_exported(const export_keys& keys);
+
+//--- f, dropping the futures exported for it once it is done, or
+//--- has failed
+template<typename T>
+hpx::future<T> release_after(hpx::future<T> f,export_keys keys) {
+  if(keys.empty())
+    return f;
+  return f.then([keys](hpx::future<T> r) {
+    release_exported(keys);
+    return r.get();
+  });
+}
+
+future_type resolve_future_ref(const future_ref& ref);
 int luax_wait_all(lua_State *L);
 int luax_when_all(lua_State *L);
 int luax_when_any(lua_State *L);
@@ -36,6 +66,7 @@ int hpx_run(lua_State *L);
 
 
 int luax_run_guarded(lua_State *L);
+int luax_run_guarded_shared(lua_State *L);
 
 int open_vector(lua_State *L);
 int open_table(lua_State *L);
@@ -48,6 +79,15 @@ int new_component(lua_State *L);
 
 int new_future(lua_State *L);
 int new_table(lua_State *L);
+int table_pairs(lua_State *L);
+int table_ipairs(lua_State *L);
+int new_ctable(lua_State *L);
+int new_channel(lua_State *L);
+int open_channel(lua_State *L);
+int new_latch(lua_State *L);
+int new_barrier(lua_State *L);
+int open_latch(lua_State *L);
+int open_barrier(lua_State *L);
 int new_vector(lua_State *L);
 //int apex_register_policy(lua_State *L);
 
@@ -57,8 +97,31 @@ const char *lua_read(lua_State *L,void *data,size_t *size);
 int lua_write(lua_State *L,const char *str,unsigned long len,std::string *buf);
 bool cmp_meta(lua_State *L,int index,const char *meta_name);
 
+int config_int(const char *key,int dflt);
+
+boost::int64_t get_gc_time(bool reset);
+boost::int64_t get_gc_steps(bool reset);
+void install_xlua_counters();
+
+void flush_write_buffers(std::vector<future_type>& futs);
+
 int open_hpx(lua_State *L);
 int open_component(lua_State *L);
+int open_dvector(lua_State *L);
+int open_globals(lua_State *L);
+int new_globals(lua_State *L);
+
+//--- A copy of the contents of "globals", tables in it are shared.
+//--- Write through set_global(), publish=false keeps it local.
+table_ptr get_globals();
+bool find_global(const key_type& key,Holder& h);
+void set_global(const key_type& key,const Holder& h,bool publish);
+void flush_global_writes(std::vector<future_type>& futs);
+
+lua_aux_client new_lua_component(const hpx::naming::id_type& loc);
+std::string compile_lua(const char *src,const char *name);
+closure_ptr getfunc(lua_State *L,int index);
+ptr_type luax_async2(closure_ptr cl,ptr_type args);
 }
 
 #endif